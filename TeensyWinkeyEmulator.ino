@@ -21,6 +21,8 @@
 // Some recent additions:
 // - supports push-button array to "play" CW messages from EEPROM
 // - support low-power mode on AVR CPUs (Uno, Leonardo, Micro, Teensy2.0)
+// - settings profiles in EEPROM, switchable by an admin command or push-button
+// - optionally run the keyer in a timer interrupt on Teensy 3.x/4.x (KEYER_ISR)
 //
 // File config.h mostly defines the hardware pins (digital input, digital output,
 // analog input) to be used. Note that when using CWKEYERSHIELD, a speed pot
@@ -68,6 +70,11 @@
 //   also operates as an USB sound card so the side tone can be mixed with
 //   the RX audio.
 //
+//   With ZEROBEAT (TEENSY4AUDIO only), the RX audio fed to the line input of
+//   the AudioShield is analyzed a few times per second, and the frequency
+//   of the dominant CW tone is reported to the host and optionally used as
+//   the side tone frequency (zero-beat).
+//
 ////////////////////////////////////////////////////////////////////////////////////////
 //
 //   K1EL Winkey (version 2.3) protocol
@@ -170,6 +177,70 @@
 #undef  POWERSAVE
 #endif
 
+#ifdef __AVR__
+// 16-bit keyer time-stamps on the 8-bit core, see tick_t
+#define TICK16
+#endif
+
+#if !defined(TEENSYDUINO) || defined(__AVR__)
+// keyer and serial interrupts require the IntervalTimer of ARM-based Teensies
+#undef KEYER_ISR
+#undef SERIAL_ISR
+#undef RTTY
+#endif
+
+#ifndef MYSERIAL
+#undef SERIAL_ISR
+#endif
+
+#ifdef HWPROFILE
+#if !defined(__IMXRT1062__) || defined(CWKEYERSHIELD)
+#error "HWPROFILE only works with Teensy 4.x and without CWKEYERSHIELD"
+#endif
+//
+// All digital and analog lines are taken from the hardware profile
+// (see hw_init), a line that is not used has the number NOPIN.
+// Therefore, all of them are "defined" here, and code that must not
+// touch an unused line checks HWPIN(line) at run-time.
+//
+#define NOPIN 255
+enum HWPROF {HW_MAGIC=0, HW_LEFT, HW_RIGHT, HW_STRAIGHT, HW_CW1, HW_CW2, HW_PTT1, HW_PTT2,
+             HW_TONEPIN, HW_POTPIN, HW_BUTTONPIN, HW_SINKS, HWPROFILE_SIZE=16};
+static uint8_t hwprofile[HWPROFILE_SIZE];
+
+#undef PaddleLeft
+#undef PaddleRight
+#undef StraightKey
+#undef CW1
+#undef CW2
+#undef PTT1
+#undef PTT2
+#undef TONEPIN
+#undef POTPIN
+#undef BUTTONPIN
+#define PaddleLeft   hwprofile[HW_LEFT]
+#define PaddleRight  hwprofile[HW_RIGHT]
+#define StraightKey  hwprofile[HW_STRAIGHT]
+#define CW1          hwprofile[HW_CW1]
+#define CW2          hwprofile[HW_CW2]
+#define PTT1         hwprofile[HW_PTT1]
+#define PTT2         hwprofile[HW_PTT2]
+#define TONEPIN      hwprofile[HW_TONEPIN]
+#define POTPIN       hwprofile[HW_POTPIN]
+#define BUTTONPIN    hwprofile[HW_BUTTONPIN]
+#define HWPIN(line)  ((line) != NOPIN)
+#define HW_MIDI      (hwprofile[HW_SINKS] & 0x01)   // send MIDI messages
+#define HW_AUDIO     (hwprofile[HW_SINKS] & 0x02)   // side tone via I2S and SGTL5000
+#ifndef USBMIDI
+#define USBMIDI
+#endif
+#ifndef TEENSY4AUDIO
+#define TEENSY4AUDIO
+#endif
+#else
+#define HWPIN(line)  1
+#endif
+
 #ifdef CWKEYERSHIELD
 
 #include "CWKeyerShield.h"
@@ -230,6 +301,48 @@
 #ifndef MY_SPEED_CTL
 #define MY_SPEED_CTL 3
 #endif
+#ifndef MY_DOT_NOTE
+#define MY_DOT_NOTE 4
+#endif
+#ifndef MY_DASH_NOTE
+#define MY_DASH_NOTE 5
+#endif
+#ifndef MY_STRAIGHT_NOTE
+#define MY_STRAIGHT_NOTE 6
+#endif
+
+//
+// Raw paddle contacts can only be sent if we do the MIDI ourselves
+//
+#if !defined(USBMIDI) && !defined(MIDIUSB)
+#undef MIDI_PADDLES
+#endif
+
+//
+// The keyer clock can only be derived from the audio sample clock
+// if there is one (see KEYER_CLOCK)
+//
+#ifndef TEENSY4AUDIO
+#undef AUDIOCLOCK
+#endif
+
+//
+// Placement of code and tables used in interrupts, see "hot code" below.
+// Measuring the cycles spent there needs the DWT counter of Teensy 4.x
+//
+#ifndef __IMXRT1062__
+#undef ISR_CYCLES
+#endif
+#if defined(ISR_CYCLES) && ISR_CYCLES == 2
+#define HOTCODE FLASHMEM   // for comparison only: code and tables in flash
+#define HOTDATA PROGMEM
+#elif defined(FASTRUN)
+#define HOTCODE FASTRUN
+#define HOTDATA
+#else
+#define HOTCODE
+#define HOTDATA
+#endif
 
 
 //
@@ -247,7 +360,8 @@ enum KSTAT {
       SENDSTRAIGHT,   // wait for releasing the straight key and send "key-up" message
       SNDCHAR_PTT,    // aquire PTT, key-down
       SNDCHAR_ELE,    // wait until end of element (dot or dash), key-up
-      SNDCHAR_DELAY   // wait until end of delay (inter-element or inter-word)
+      SNDCHAR_DELAY,  // wait until end of delay (inter-element or inter-word)
+      SNDRTTY         // RTTY: aquire PTT, pass characters to the FSK interrupt
       } keyer_state=CHECK;
 
 //
@@ -299,7 +413,16 @@ enum WKSTAT {
   MESSAGE,
   POINTER_1,
   POINTER_2,
-  POINTER_3
+  POINTER_3,
+  LDPROFILE,
+  SVPROFILE,
+  HWPROFSEL,
+  ZBMODE,
+  BRKMODE,
+  MIDIPAD,
+  STVOLUME,
+  XVOLUME,
+  RTTYREG
 } winkey_state=FREE;
 
 enum ADMIN_COMMAND {
@@ -328,7 +451,23 @@ enum ADMIN_COMMAND {
   ADMIN_LOADX2     = 22, // WK3 only
   ADMIN_GETMINOR   = 23, // Firmware minor version, WK3 only
   ADMIN_GETTYPE    = 24, // Get IC Type, WK3 only
-  ADMIN_VOLUME     = 25  // Set side tone volume low/high, WK3 only
+  ADMIN_VOLUME     = 25, // Set side tone volume low/high, WK3 only
+  //
+  // PROTOCOL EXTENSION: admin commands not in the K1EL chip
+  //
+  ADMIN_XPROFILE   = 48, // Select settings profile (1 byte: profile number)
+  ADMIN_XSVPROFILE = 49, // Store current settings in profile (1 byte: profile number)
+  ADMIN_XHWPROFILE = 50, // Store hardware profile preset (1 byte: preset number)
+  ADMIN_XZEROBEAT  = 51, // Set zero-beat mode (1 byte: 0=off, 1=measure, 2=measure and retune)
+  ADMIN_XZBOFFSET  = 52, // Get zero-beat offset (returns 2 bytes)
+  ADMIN_XLATENESS  = 53, // Get max. keyer lateness since last query (returns 1 byte)
+  ADMIN_XBREAKIN   = 54, // Set break-in mode (1 byte: 0=clear, 1-254=resume after n*100 msec, 255=pause)
+  ADMIN_XREMAINDER = 55, // Get unsent buffer contents (returns count, then the bytes)
+  ADMIN_XMIDIPAD   = 56, // Paddle contacts as MIDI notes (1 byte: 0=off, 1=on)
+  ADMIN_XINLATENCY = 57, // Get max. input event latency since last query (returns 1 byte)
+  ADMIN_XCYCLES    = 58, // Get max. CPU cycles in interrupts since last query (returns 8 bytes)
+  ADMIN_XVOLUME    = 59, // Set side tone and RX audio volume (2 bytes: 0-255 each)
+  ADMIN_XBOOTTIME  = 60  // Get start-up times (returns 6 bytes)
 };
 
 
@@ -408,6 +547,9 @@ static uint8_t PinConfig=0x0E;          // addr=0x0e // PTT disabled
                                         // addr=0x16 // MsgPtr5
                                         // addr=0x17 // MsgPtr6
 
+#define PROFILE_BASE  256                 // EEPROM addr of first settings profile
+#define PROFILE_SIZE   16                 // EEPROM bytes per settings profile
+
 //
 // Macros to read the ModeRegister
 //
@@ -441,7 +583,11 @@ static uint8_t ps1;                     // first byte of a pro-sign
 static uint8_t pausing=0;               // "pause" state
 static uint8_t breakin=1;               // breakin state
 static uint8_t straight=0;              // state of the straight key (1 = pressed, 0 = released)
-static uint8_t tuning=0;                // "Tune" mode active, deactivate paddle
+static uint8_t kstraight=0;             // straight key contact (differs from straight in BUG mode)
+#ifdef MIDI_PADDLES
+static uint8_t paddle_midi=MIDI_PADDLES; // 1: paddle contacts go to the host as MIDI notes, not to the keyer
+#endif
+static volatile uint8_t tuning=0;       // "Tune" mode active, deactivate paddle
 static uint8_t hostmode  = 0;           // host mode
 static uint8_t SpeedPot =  0;           // Speed value from the Potentiometer
 static uint16_t myfreq=800;             // current side tone frequency
@@ -454,13 +600,227 @@ static uint8_t num_elements=0;          // number of elements sent in a sequence
 //
 // Ring buffer for characters queued for sending
 //
-#define BUFLEN 128     // number of bytes in buffer (much larger than in K1EL chip)
+// The read and write pointers are free-running 8-bit counters, and the
+// number of characters in the buffer is their difference. The WinKey
+// state machine only advances buftx, and the keyer only advances bufrx,
+// so queueing and fetching need no locking even if the keyer runs in an
+// interrupt (KEYER_ISR). All other buffer manipulations are rare and done
+// with the keyer interrupt blocked.
+//
+// Pointer commands address buffer positions relative to bufbase, which is
+// the position of the first character queued after the buffer was cleared
+// or has run empty. If the host keeps streaming without the buffer running
+// empty, bufbase is advanced by BUFLEN once that many characters have been
+// sent, so that positions always fit into the 8-bit pointers (that is,
+// they then count modulo BUFLEN). In "overwrite" mode, characters from the host are
+// written at bufwr (overwriting what is there) until bufwr reaches the end
+// of the buffer, from then on they are appended again.
+//
+#define BUFLEN 128     // number of bytes in buffer (much larger than in K1EL chip), power of two
 #define BUFMARGIN 85   // water mark for reporting "buffer almost full"
 
-static unsigned char character_buffer[BUFLEN];  // circular buffer
-static uint8_t bufrx=0;                         // output (read) pointer
-static uint8_t buftx=0;                         // input (write) pointer
-static uint8_t bufcnt=0;                        // number of characters in buffer
+static volatile unsigned char character_buffer[BUFLEN];  // circular buffer
+static volatile uint8_t bufrx=0;                         // output (read) pointer
+static volatile uint8_t buftx=0;                         // input (write) pointer
+
+static uint8_t bufbase=0;                                // logical position 0 for pointer commands
+static uint8_t bufwr=0;                                  // write position in overwrite mode
+static uint8_t bufovr=0;                                 // set if in overwrite mode
+
+#define bufcount() ((uint8_t) (buftx - bufrx))           // number of characters in buffer
+
+#ifdef BREAKIN_RESUME
+//
+// Break-in with the paddle or straight key: 0 = clear the buffer (as the K1EL chip),
+// 1-254 = pause, and resume after n*100 msec without keying, 255 = pause until
+// the host ends the pause. See keyer_state_machine().
+//
+static uint8_t breakin_mode=BREAKIN_RESUME;
+static uint8_t breakin_paused=0;                         // set if paused by break-in
+static uint8_t charstart=0;                              // bufrx before the character being sent
+#endif
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// With KEYER_ISR, paddle sampling and the keyer state machine run in
+// a high-priority timer interrupt at a fixed rate (KEYER_RATE Hz),
+// so keying jitter is bounded by the tick period no matter what loop()
+// is doing. loop() only does the non-real-time work (WinKey protocol,
+// analog inputs, MIDI) and drains the keyer events.
+//
+#ifdef KEYER_ISR
+#define KEYER_RATE 10000
+static IntervalTimer keyer_timer;
+
+#define LOCK_KEYER   noInterrupts()
+#define UNLOCK_KEYER interrupts()
+#else
+#define LOCK_KEYER
+#define UNLOCK_KEYER
+#endif
+
+//
+// Hot code: everything that runs in the audio, keyer and serial interrupts.
+//
+// On Teensy 4.x, code and tables in flash are read through a small cache,
+// and a cache miss costs a few hundred CPU cycles. What matters for
+// keying jitter and audio drop-outs is the worst case, therefore these
+// functions are put in ITCM (HOTCODE) and the side tone tables in DTCM
+// (HOTDATA). Teensyduino does this anyway with code and const data not
+// marked FLASHMEM or PROGMEM, here this is made explicit. On Teensy 3.x,
+// HOTCODE runs the code from RAM instead of flash.
+// The Arduino IDE generates prototypes without attributes, so the
+// attributes are given with these declarations. GCC ignores them for
+// function templates, so sample_inputs_mode() stays where the linker
+// puts it (in ITCM on Teensy 4.x).
+//
+// With ISR_CYCLES, the max. number of CPU cycles per audio block and per
+// keyer interrupt is recorded (see ADMIN_XCYCLES), ISR_CYCLES=2 places
+// the same code and tables in flash for comparison.
+//
+HOTCODE void keyer_tick();
+HOTCODE void keyer_state_machine();
+HOTCODE void deadline_met();
+HOTCODE void keydown();
+HOTCODE void keyup();
+HOTCODE void post_event(uint8_t ev, uint8_t val);
+HOTCODE void post_input(uint8_t src, uint8_t val);
+HOTCODE void apply_inputs();
+HOTCODE int  FromBuffer();
+#ifdef USBTXAUDIO
+HOTCODE uint32_t key_stamp();
+#endif
+#ifdef RTTY
+HOTCODE void rtty_line(uint8_t mark);
+HOTCODE void rtty_tick();
+#endif
+#ifdef SERIAL_ISR
+HOTCODE void serial_poll();
+HOTCODE void serial_scan(uint8_t byte, uint8_t pos);
+#endif
+
+#ifdef ISR_CYCLES
+static volatile uint32_t cycles_audio=0;    // max. CPU cycles for one side tone audio block
+static volatile uint32_t cycles_keyer=0;    // max. CPU cycles for one keyer interrupt
+#define CYCLES_START     uint32_t cycles_t0=ARM_DWT_CYCCNT
+#define CYCLES_STOP(max) do { uint32_t c=ARM_DWT_CYCCNT-cycles_t0; if (c > max) max=c; } while (0)
+#else
+#define CYCLES_START
+#define CYCLES_STOP(max)
+#endif
+
+//
+// With SERIAL_ISR, bytes from the host are fetched in a timer interrupt
+// and staged in a lock-free queue, see serial_poll().
+//
+#ifdef SERIAL_ISR
+#define SERIAL_RATE 5000
+#define SERLEN 256                          // must match 8-bit counters
+
+static IntervalTimer serial_timer;
+static volatile uint8_t serbuf[SERLEN];     // staging queue
+static volatile uint8_t serrx=0;            // read  pointer (WinKey state machine)
+static volatile uint8_t sertx=0;            // write pointer (interrupt)
+static volatile uint8_t serclear;           // position after the most recent CLEAR
+static volatile uint8_t serclearpend=0;     // set while CLEAR not yet read
+static volatile uint8_t serdiscard=0;       // set while reading bytes preceding CLEAR
+static volatile uint8_t clear_request=0;    // tells the keyer to discard its buffer
+#endif
+
+//
+// With RTTY, text from the host can be sent as FSK on the CW lines, see rtty_tick().
+// The keyer state machine puts Baudot codes into a small queue, a timer interrupt
+// sends them bit by bit.
+//
+#ifdef RTTY
+#define RTTY_QLEN 4                         // must be a power of two
+
+static IntervalTimer rtty_timer;
+static volatile uint8_t rtty_on=0;          // RTTY mode (set by ADMIN_RTTY)
+static uint8_t rtty_reg1=0;                 // RTTY registers (ADMIN_RTTY)
+static uint8_t rtty_reg2=0;
+static uint8_t rtty_figs=0;                 // shift state of the queued characters
+static volatile uint8_t rtty_q[RTTY_QLEN];  // Baudot codes
+static volatile uint8_t rtty_qrx=0;         // read  pointer (interrupt)
+static volatile uint8_t rtty_qtx=0;         // write pointer (keyer)
+static volatile uint16_t rtty_bits;         // half-bits of the current character
+static volatile uint8_t rtty_nbits=0;       // number of half-bits still to send
+#define RTTY_ACTIVE rtty_on
+#else
+#define RTTY_ACTIVE 0
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Fast digital I/O for the key inputs and the CW/PTT outputs.
+//
+// On AVR, digitalRead() and digitalWrite() look up port and bit of the pin
+// in tables (in flash memory) upon each call. Here this is done only once,
+// in setup(), and then the port registers are accessed directly. If both
+// paddle contacts are on the same port, they are read with a single access.
+// On Teensy 3.x/4.x, digitalReadFast() and digitalWriteFast() with constant
+// pin numbers compile to a single instruction.
+//
+// fastread(fp,pin) and fastwrite(fp,pin,val) take both the FASTPIN index and the
+// pin number, since which one is needed depends on the CPU.
+//
+// With HWPROFILE, the pin numbers are not known at compile time. Therefore the
+// GPIO registers and bit masks are looked up once in setup() as on AVR. Unused
+// lines are mapped to a dummy register (which reads "contact open").
+//
+enum FASTPIN {FP_LEFT=0, FP_RIGHT, FP_STRAIGHT, FP_CW1, FP_CW2, FP_PTT1, FP_PTT2, FP_NUM};
+
+#if defined(__AVR__)
+static volatile uint8_t *fastpin_reg[FP_NUM];   // PINx (inputs) or PORTx (outputs) register
+static uint8_t fastpin_mask[FP_NUM];            // bit mask within that register
+
+void fastpin_init(uint8_t fp, uint8_t pin, uint8_t output) {
+  uint8_t port=digitalPinToPort(pin);
+  fastpin_reg[fp]=output ? portOutputRegister(port) : portInputRegister(port);
+  fastpin_mask[fp]=digitalPinToBitMask(pin);
+}
+
+#define fastread(fp,pin) ((*fastpin_reg[fp] & fastpin_mask[fp]) ? HIGH : LOW)
+
+//
+// Other bits of the output port may be changed from interrupts (e.g. by tone()),
+// therefore the read-modify-write must not be interrupted.
+//
+#define fastwrite(fp,pin,val) do {                                     \
+          uint8_t oldSREG=SREG; cli();                                  \
+          if (val) *fastpin_reg[fp] |= fastpin_mask[fp];                \
+          else     *fastpin_reg[fp] &= ~fastpin_mask[fp];               \
+          SREG=oldSREG; } while (0)
+#elif defined(HWPROFILE)
+static volatile uint32_t *fastpin_reg[FP_NUM];  // PSR (inputs) or DR_SET (outputs) register
+static volatile uint32_t *fastpin_clr[FP_NUM];  // DR_CLEAR register (outputs)
+static uint32_t fastpin_mask[FP_NUM];           // bit mask within these registers
+static volatile uint32_t fastpin_dummy=1;       // for unused lines
+
+void fastpin_init(uint8_t fp, uint8_t pin, uint8_t output) {
+  if (pin == NOPIN) {
+    fastpin_reg[fp]=fastpin_clr[fp]=&fastpin_dummy;
+    fastpin_mask[fp]=1;
+    return;
+  }
+  fastpin_reg[fp]=output ? portSetRegister(pin) : portInputRegister(pin);
+  fastpin_clr[fp]=portClearRegister(pin);
+  fastpin_mask[fp]=digitalPinToBitMask(pin);
+}
+
+#define fastread(fp,pin) ((*fastpin_reg[fp] & fastpin_mask[fp]) ? HIGH : LOW)
+#define fastwrite(fp,pin,val) do {                                     \
+          if (val) *fastpin_reg[fp]=fastpin_mask[fp];                   \
+          else     *fastpin_clr[fp]=fastpin_mask[fp];                   \
+          } while (0)
+#elif defined(TEENSYDUINO)
+#define fastread(fp,pin)       digitalReadFast(pin)
+#define fastwrite(fp,pin,val)  digitalWriteFast(pin,val)
+#else
+#define fastread(fp,pin)       digitalRead(pin)
+#define fastwrite(fp,pin,val)  digitalWrite(pin,val)
+#endif
 //
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -474,9 +834,51 @@ static uint8_t collecting=0;    // bitmap for character entered with the paddle
 static uint8_t collpos=0;       // position for collecting
 static uint8_t sentspace=1;     // space already sent for inter-word distance
 static uint8_t ReplayPointer=0; // This indicates a message is being sent
-static unsigned long wait=0;    // when "actual" reaches this value terminate current keyer state
-static unsigned long last=0;    // time of last enddot/enddash
-static unsigned long actual;    // time-stamp for this execution of loop()
+//
+// Keyer time-stamps (msec). With TICK16 (AVR) they are only 16 bits wide, which
+// saves about half of the cycles of each of the many time comparisons per loop()
+// on an 8-bit core. They wrap around every 65.5 seconds then, so times are only
+// compared with REACHED() and PASSED(), which look at the signed difference:
+// this is correct as long as both are less than 32.7 seconds apart. All intervals
+// timed this way (elements, gaps, PTT, debouncing, break-in resume) are shorter
+// than 28.7 seconds (TICK_STALE), and time-stamps that can get older than that
+// are pulled along by tick_age(). Long timers (POWERSAVE) use millis().
+//
+#ifdef TICK16
+typedef uint16_t tick_t;
+typedef int16_t  tickdiff_t;
+#else
+typedef unsigned long tick_t;
+typedef long          tickdiff_t;
+#endif
+#define TICK_STALE 0x7000
+
+#ifndef TICK_PROBE
+#define TICK_PROBE(x) (x)       // hostsim counts the time comparisons through this
+#endif
+#define REACHED(t) TICK_PROBE((tickdiff_t) (actual - (t)) >= 0)   // actual >= t
+#define PASSED(t)  TICK_PROBE((tickdiff_t) (actual - (t)) >  0)   // actual >  t
+
+static tick_t wait=0;           // when "actual" reaches this value terminate current keyer state
+static tick_t chain=0;          // end of previous character, if the next one chains to it
+static uint8_t late_max=0;      // max. lateness (msec) of a keyer deadline, see ADMIN_XLATENESS
+#ifdef AUDIOCLOCK
+static tick_t key_edge;         // deadline just met by the keyer state machine, see key_stamp()
+static uint8_t key_edge_valid=0;
+#endif
+static tick_t last=0;           // time of last enddot/enddash
+static tick_t actual;           // time-stamp for this execution of loop()
+static tick_t straight_pressed; // for timing straight key signals
+
+//
+// The keyer's clock (msec): millis(), or with AUDIOCLOCK derived from the
+// audio sample clock (see SideToneSource)
+//
+#ifdef AUDIOCLOCK
+#define KEYER_CLOCK() sidetone.clock_ms()
+#else
+#define KEYER_CLOCK() millis()
+#endif
 #ifdef POWERSAVE
 static unsigned long watchdog;  // used for going to sleep
 #endif
@@ -486,9 +888,13 @@ static unsigned long watchdog;  // used for going to sleep
 //
 static uint8_t kdot = 0;      // This variable reflects the value of the dot paddle
 static uint8_t kdash = 0;     // This value reflects the value of the dash paddle
+static uint8_t pdot = 0;      // dot paddle contact (kdot may also be closed by SOFTPAD)
+static uint8_t pdash = 0;     // dash paddle contact (kdash may also be closed by SOFTPAD)
+static uint8_t softpad = 0;   // software paddle from the host (bit 0: dot, bit 1: dash, bit 2: straight)
 static uint8_t memdot=0;      // set, if dot paddle hit since the beginning of the last dash
 static uint8_t memdash=0;     // set,  if dash paddle hit since the beginning of the last dot
 static uint8_t lastpressed=0; // Indicates which paddle was pressed last (for ULTIMATIC)
+static uint8_t iambic_a=1;    // copy of IAMBIC_A, see paddle_mode_select()
 static uint8_t eff_kdash;     // effective kdash (may be different from kdash in BUG and ULTIMATIC mode)
 static uint8_t eff_kdot;      // effective kdot  (may be different from kdot in ULTIMATIC mode)
 
@@ -498,6 +904,26 @@ static uint8_t dot_held=0;   // dash paddle state at the beginning of the last d
 static uint8_t ptt_stat=0;   // current PTT status
 static uint8_t cw_stat=0;    // current CW output line status
 
+//
+// input event bus, see post_input()
+//
+enum INSRC {
+  IN_STRAIGHT,                  // straight key contact (val: 1 = closed)
+  IN_DOT,                       // dot paddle contact
+  IN_DASH,                      // dash paddle contact
+  IN_SOFTPAD,                   // software paddle (val: bit 0 dot, bit 1 dash, bit 2 straight)
+  IN_MESSAGE                    // start message (val: EEPROM address, 0 = stop)
+};
+
+#define INLEN 16                // length of the input queue, must be a power of two
+
+static uint8_t       in_src[INLEN];
+static uint8_t       in_val[INLEN];
+static tick_t        in_time[INLEN];
+static uint8_t       in_rx=0;   // next event to apply (mod INLEN)
+static uint8_t       in_tx=0;   // next free slot (mod INLEN)
+static uint8_t       in_lat_max=0; // max. latency (msec) of an input event
+
 #ifdef CWKEYERSHIELD
 
 //
@@ -568,6 +994,15 @@ CWKeyerShield cwshield(SHIELD_AUDIO_OUTPUT,
 
 void init_eeprom();
 
+#ifndef TEENSY4AUDIO
+#undef ZEROBEAT             // needs the AudioShield line input
+#undef USBTXAUDIO           // needs the side tone generator
+#endif
+
+#if defined(USBTXAUDIO) && !defined(AUDIO_INTERFACE)
+#error "USBTXAUDIO needs a USB type with audio (e.g. Serial + MIDI + Audio)"
+#endif
+
 #ifdef TEENSY4AUDIO
 
 #include "Audio.h"
@@ -577,17 +1012,43 @@ void init_eeprom();
 // Sine oscillator with off/on and pulse shaper
 // All is integrated into a monolithic block
 // to minimize computational overhead.
-// The only methods are on/off and setting the frequency.
+// The only methods are on/off, setting the frequency and the volume.
 // A stereo output with both channels being equal is produced.
 //
+// The volume is a digital gain, and RX audio (if connected to the input)
+// can be mixed in with a gain of its own. Changing the volume only stores
+// the new value (no I2C transaction with the codec, which would stall the
+// loop), update() takes it once per block and moves the gain there within
+// the block, so there are no clicks. The codec volume is only set once.
+//
+// With USBTXAUDIO, there are two more outputs for the USB audio stream to
+// the host, for SDR programs that transmit CW from an audio signal:
+// output 2 is a keyed tone (side tone frequency, full scale) and output 3
+// the keying envelope (0 ... 32767). Both follow the key, not the side tone
+// on/off switch, with the same ramp. The key-down/up times are recorded
+// (micros) by key(), and update() places each change at the corresponding
+// sample of the *next* block. So the keying on the USB stream is delayed by
+// one block (2.9 msec) but accurate to about one sample, instead of being
+// rounded to blocks.
+//
+// With AUDIOCLOCK, update() also counts the samples, and clock_ms() is the
+// keyer's clock: msec derived from the sample count (plus the time since
+// the last update), so the keyer and the audio cannot drift apart. A key
+// change is then stamped with a sample index rather than micros: the
+// deadline of the element (if the change was scheduled) converted to
+// samples, plus a margin of 1 msec so the keyer may notice the deadline
+// a little late. Until the audio system runs, clock_ms() is millis().
+//
 class SideToneSource : public AudioStream
 {
 public:
-    SideToneSource() : AudioStream(0, NULL),
+    SideToneSource() : AudioStream(1, inputQueueArray),
                        tone(0),  phase(0), incr(0),
-                       rampindex(0) {}
+                       rampindex(0),
+                       gain_target(32768), rxgain_target(0),
+                       gain(32768), rxgain(0) {}
 
-    virtual void update(void);
+    HOTCODE virtual void update(void);
 
     void set_frequency(int frequency) {
       if (frequency < 0) frequency = 0;
@@ -599,11 +1060,107 @@ public:
         tone = state;
     }
 
+#ifdef USBTXAUDIO
+    //
+    // Key-down/up for the USB outputs. If the queue is full (cannot
+    // happen with real CW), the change is dropped and the key state is
+    // re-synchronized once the queue has run empty.
+    //
+    void key(uint8_t state, uint32_t stamp) {
+        uint8_t h = keyq_head;
+        uint8_t n = (h + 1) % KEYQ_LEN;
+        keystate = state;
+        if (n != keyq_tail) {
+          keyq_time[h]  = stamp;
+          keyq_state[h] = state;
+          keyq_head = n;
+        }
+    }
+#endif
+
+#ifdef AUDIOCLOCK
+    //
+    // Current position in the sample stream. update() changes clock_samples
+    // and last_update with interrupts disabled, so an interrupt always sees
+    // both from the same block. In loop(), the sequence counter tells
+    // whether update() came in between.
+    //
+    uint64_t sample_now() {
+      uint64_t smp;
+      uint32_t dt, seq;
+      do {
+        seq = clock_seq;
+        smp = clock_samples;
+        dt  = micros() - last_update;
+      } while (seq != clock_seq);
+      uint32_t frac = dt * (AUDIO_SAMPLE_RATE_EXACT / 1000000.0f);
+      if (frac >= AUDIO_BLOCK_SAMPLES) frac = AUDIO_BLOCK_SAMPLES - 1;
+      return smp + frac;
+    }
+
+    uint32_t clock_ms() {
+      if (!clock_running) return millis();
+      return clock_base + (uint32_t) (uint64_t) (sample_now() * (1000.0 / AUDIO_SAMPLE_RATE_EXACT));
+    }
+
+    //
+    // keyer time (msec) to sample index, the inverse of clock_ms()
+    //
+    uint32_t ms_to_sample(uint32_t ms) {
+      return (uint32_t) (int64_t) ((int32_t) (ms - clock_base) * (AUDIO_SAMPLE_RATE_EXACT / 1000.0) + 0.5);
+    }
+#endif
+
+    //
+    // volume 0 ... 255 (255 = full scale) of the side tone and the RX audio
+    //
+    void set_volume(uint8_t vol) {
+        gain_target = vol ? (vol << 7) + 128 : 0;
+    }
+
+    void set_rx_volume(uint8_t vol) {
+        rxgain_target = vol ? (vol << 7) + 128 : 0;
+    }
+
 private:
     uint8_t  tone;         // tone on/off flag
     uint32_t phase;
     uint32_t incr;
     uint8_t  rampindex;  // pointer into the "ramp"
+    volatile uint16_t gain_target;    // side tone gain (32768 = 1.0), set by loop()
+    volatile uint16_t rxgain_target;  // RX audio gain (32768 = 1.0), set by loop()
+    uint16_t gain;                    // side tone gain at the end of the last block
+    uint16_t rxgain;                  // RX audio gain at the end of the last block
+    audio_block_t *inputQueueArray[1];
+#if defined(USBTXAUDIO) || defined(AUDIOCLOCK)
+    volatile uint32_t last_update = 0;        // micros() at the last update()
+#endif
+#ifdef AUDIOCLOCK
+    volatile uint64_t clock_samples = 0;      // samples up to the block being played
+    volatile uint32_t clock_seq = 0;          // incremented by each update()
+    uint32_t clock_base = 0;                  // keyer time (msec) of sample 0
+    volatile uint8_t  clock_running = 0;
+#endif
+#ifdef USBTXAUDIO
+    static constexpr int KEYQ_LEN=8;
+    volatile uint32_t keyq_time[KEYQ_LEN];    // micros() or sample index of key changes
+    volatile uint8_t  keyq_state[KEYQ_LEN];
+    volatile uint8_t  keyq_head = 0;          // written by key()
+    volatile uint8_t  keyq_tail = 0;          // written by update()
+    volatile uint8_t  keystate = 0;           // latest key state
+    uint8_t  txkey = 0;                       // key state at the end of the last block
+    uint8_t  txrampindex = 0;                 // pointer into the ramp, USB outputs
+
+    //
+    // sample index (in this block) of the key change in queue slot q,
+    // AUDIO_BLOCK_SAMPLES if it belongs to a later block
+    //
+    int key_sample(uint8_t q, uint32_t start, uint32_t span) {
+      uint32_t d = keyq_time[q] - start;
+      if (d > 0x80000000) return 0;          // stamped before the block started
+      return (d < span) ? (d * AUDIO_BLOCK_SAMPLES) / span : AUDIO_BLOCK_SAMPLES;
+    }
+#endif
 
     //
     // Both the Ramp and the Sine table have been produces with MATHEMATICA
@@ -613,7 +1170,7 @@ private:
     // The Blackman-Harris-Ramp has a width of 5 msec
     //
     static constexpr int RAMP_LENGTH=240;
-    static constexpr uint16_t BlackmanHarrisRamp[RAMP_LENGTH] = {
+    static constexpr uint16_t BlackmanHarrisRamp[RAMP_LENGTH] HOTDATA = {
       0,      0,      0,      0,      1,      1,      1,      2,
       2,      3,      4,      5,      7,      9,     11,     13,
      16,     20,     23,     28,     33,     39,     46,     54,
@@ -647,7 +1204,7 @@ private:
 };
 
     static constexpr int SinTabLen = 257;
-    static constexpr int16_t SineTab[SinTabLen] = {
+    static constexpr int16_t SineTab[SinTabLen] HOTDATA = {
         0,      804,     1608,     2410,     3212,     4011,     4808,     5602,
      6393,     7179,     7962,     8739,     9512,    10278,    11039,    11793,
     12539,    13279,    14010,    14732,    15446,    16151,    16846,    17530,
@@ -686,12 +1243,73 @@ private:
 };
 
 void SideToneSource::update() {
-  audio_block_t *block;
+  audio_block_t *block, *rx;
+#ifdef USBTXAUDIO
+  audio_block_t *txtone = NULL, *txenv = NULL;
+#endif
+#if defined(USBTXAUDIO) || defined(AUDIOCLOCK)
+  uint32_t now;
+#endif
+#ifdef USBTXAUDIO
+  uint32_t start, span;
+#endif
+  CYCLES_START;
+  rx = receiveReadOnly(0);  // RX audio, NULL if none
+#if defined(USBTXAUDIO) || defined(AUDIOCLOCK)
+  //
+  // This block stands for the time since the last update(). A key
+  // change at time t goes to sample (t-start)*128/span. With AUDIOCLOCK,
+  // the time stamps are sample indices, so this is simply t-start.
+  //
+  noInterrupts();
+  now = micros();
+#ifdef AUDIOCLOCK
+  if (!clock_running) {
+    //
+    // clock_samples already includes this block when clock_ms() is read
+    // next, so count back one block (rounded down, so that the clock
+    // does not step back either): the keyer clock continues from millis()
+    //
+    clock_base = millis() - (uint32_t) (AUDIO_BLOCK_SAMPLES * 1000 / AUDIO_SAMPLE_RATE_EXACT);
+    clock_running = 1;
+  }
+#ifdef USBTXAUDIO
+  start = (uint32_t) clock_samples;
+  span = AUDIO_BLOCK_SAMPLES;
+#endif
+  clock_samples += AUDIO_BLOCK_SAMPLES;
+  clock_seq++;
+#else
+  span = now - last_update;
+  if (span == 0 || span > 100000) span = 1;  // first call, or audio restarted
+  start = now - span;
+#endif
+  last_update = now;
+  interrupts();
+#endif
   //if (tone || rampindex) {
     block = allocate();
     if (block) {
       uint32_t ph = phase;  // use local variable to allow for compiler optimization
       uint32_t in = incr;   // use local variable to allow for compiler optimization
+#ifdef USBTXAUDIO
+      uint8_t tk = txkey;
+      uint8_t tr = txrampindex;
+      uint8_t qt = keyq_tail;
+      int next = (qt != keyq_head) ? key_sample(qt, start, span) : -1;
+      txtone = allocate();
+      txenv  = allocate();
+#endif
+      //
+      // The gains move linearly to their new values within the block.
+      // g and rg are the gains (32768 = 1.0) with 15 fractional bits.
+      // They end within 1/32768 of the target for any AUDIO_BLOCK_SAMPLES
+      // (exactly on it if that is a power of two).
+      //
+      uint16_t gt = gain_target;
+      uint16_t rt = rxgain_target;
+      int32_t g  = (int32_t) gain << 15,   dg = ((int32_t) gt - gain) * 32768 / AUDIO_BLOCK_SAMPLES;
+      int32_t rg = (int32_t) rxgain << 15, drg = ((int32_t) rt - rxgain) * 32768 / AUDIO_BLOCK_SAMPLES;
       for (int i=0; i<AUDIO_BLOCK_SAMPLES; i++) {
         int ind = ph >> 24;                  // bits 24-31 of phase: index to SineTab
         uint32_t scal = (ph >> 8) & 0xFFFF;  // bits 8-16  of phase: used for interpolation
@@ -704,25 +1322,62 @@ void SideToneSource::update() {
         // We must use upper 16 bits of val1+val2 if we have climbed the ramp.
         // Within the ramp, take ((val1+val2)*ramp) >> 32
         //
+        int32_t val;
         if (tone) {
           if (rampindex < RAMP_LENGTH) {
             // key-down, still climbing the ramp
             uint16_t ramp = BlackmanHarrisRamp[rampindex++];
-            block->data[i] = multiply_32x32_rshift32(val1 + val2, ramp);
+            val = multiply_32x32_rshift32(val1 + val2, ramp);
           } else {
             // key-down, max. amplitude reached
-            block->data[i] = (val1 + val2) >> 16;
+            val = (val1 + val2) >> 16;
           }
         } else if (rampindex) {
           // key-up but still descending the ramp
           uint16_t ramp = BlackmanHarrisRamp[--rampindex];
-          block->data[i] = multiply_32x32_rshift32(val1 + val2, ramp);
+          val = multiply_32x32_rshift32(val1 + val2, ramp);
         } else {
           // key-down and pulse completed
-          block->data[i]=0;
+          val = 0;
+        }
+#ifdef USBTXAUDIO
+        //
+        // USB outputs: same ramp, but following the time-stamped key changes
+        //
+        while (next == i) {
+          tk = keyq_state[qt];
+          qt = (qt + 1) % KEYQ_LEN;
+          next = (qt != keyq_head) ? key_sample(qt, start, span) : -1;
+          if (next >= 0 && next < i) next = i;
+        }
+        uint16_t txramp;
+        if (tk) {
+          txramp = (tr < RAMP_LENGTH) ? BlackmanHarrisRamp[tr++] : 65535;
+        } else {
+          txramp = tr ? BlackmanHarrisRamp[--tr] : 0;
         }
+        if (txtone) txtone->data[i] = multiply_32x32_rshift32(val1 + val2, txramp);
+        if (txenv)  txenv->data[i]  = txramp >> 1;
+#endif
+        g += dg;
+        val = (val * (g >> 15)) >> 15;
+        if (rx) {
+          rg += drg;
+          val += (rx->data[i] * (rg >> 15)) >> 15;
+          if (val >  32767) val =  32767;
+          if (val < -32768) val = -32768;
+        }
+        block->data[i] = val;
       }
       phase = ph;
+      gain = gt;
+      rxgain = rt;
+#ifdef USBTXAUDIO
+      keyq_tail = qt;
+      if (qt == keyq_head) tk = keystate;    // re-sync after a queue overflow
+      txkey = tk;
+      txrampindex = tr;
+#endif
       //
       // transmit the side tone to left and right channel, then release
       //
@@ -731,23 +1386,130 @@ void SideToneSource::update() {
       release(block);
     }
   //}
+#ifdef USBTXAUDIO
+  if (txtone) {
+    transmit(txtone, 2);
+    release(txtone);
+  }
+  if (txenv) {
+    transmit(txenv, 3);
+    release(txenv);
+  }
+#endif
+  if (rx) release(rx);
+  CYCLES_STOP(cycles_audio);
 }
 
+#ifdef HWPROFILE
+AudioOutputI2S           *i2s;                          // audio output, only created if used
+#else
 AudioOutputI2S           i2s;                           // audio output
+#endif
 AudioControlSGTL5000     sgtl5000;                      // controller for SGTL volume etc.
 SideToneSource           sidetone;                      // our side tone generator
+#ifdef USBTXAUDIO
+AudioOutputUSB           usb_out;                       // keyed tone and envelope to the host
+#endif
+
+#ifdef ZEROBEAT
+#include "arm_math.h"
+//
+// Zero-beat analyzer, part 1: collect RX audio
+//
+// Within the audio update, groups of four samples are added up (decimation
+// to 11 kHz, a crude low-pass that is OK since the RX audio of a radio
+// usually ends below 3 kHz) and stored as float, until ZB_N values are
+// collected. This costs next to nothing. The buffer is then handed over to
+// zerobeat_poll(), which does the FFT outside the audio interrupt, and
+// only every ZB_INTERVAL msec.
+//
+#define ZB_N        1024                                // FFT length
+#define ZB_DECIM    4                                   // decimation factor
+#define ZB_RATE     (AUDIO_SAMPLE_RATE_EXACT/ZB_DECIM)  // 11025 Hz, 10.8 Hz per FFT bin
+#define ZB_FMIN     250                                 // search range for the CW tone (Hz)
+#define ZB_FMAX     1500
+#define ZB_INTERVAL 250                                 // msec between two analyses
+#define ZB_SNR      20.0f                               // peak power vs. average power in range
+
+class ZeroBeatSink : public AudioStream
+{
+public:
+    ZeroBeatSink() : AudioStream(1, inputQueueArray),
+                     count(0), full(0) {}
+
+    HOTCODE virtual void update(void);
+
+    //
+    // If ready() returns true, data[] belongs to loop() until restart() is called
+    //
+    uint8_t ready() {
+      return full;
+    }
+
+    void restart() {
+      count = 0;
+      full  = 0;
+    }
+
+    float data[ZB_N];
+
+private:
+    audio_block_t *inputQueueArray[1];
+    uint16_t count;
+    volatile uint8_t full;
+};
+
+void ZeroBeatSink::update() {
+  audio_block_t *block;
+  block = receiveReadOnly(0);
+  if (block) {
+    if (!full) {
+      uint16_t n = count;
+      for (int i=0; i<AUDIO_BLOCK_SAMPLES; i += ZB_DECIM) {
+        int32_t sum = 0;
+        for (int j=0; j<ZB_DECIM; j++) {
+          sum += block->data[i+j];
+        }
+        data[n++] = sum;
+        if (n >= ZB_N) {
+          full = 1;
+          break;
+        }
+      }
+      count = n;
+    }
+    release(block);
+  }
+}
+
+#ifdef HWPROFILE
+AudioInputI2S            *i2s_in;                       // RX audio input, only created if used
+#else
+AudioInputI2S            i2s_in;                        // RX audio input
+#endif
+ZeroBeatSink             zerobeat;                      // RX audio collector
+#endif
 
 
 #endif
 
 
 
+//
+// Start-up times (msec since reset), see deferred_init()
+//
+static uint32_t boot_keyer=0;      // keyer live (end of setup)
+static uint32_t boot_audio=0;      // deferred initialization complete
+static uint32_t boot_firstkey=0;   // first key-down
+static uint8_t  boot_keyed=0;      // set once boot_firstkey is valid
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // setup:
 // Initialize serial port and hardware lines
 // init eeprom or load settings from eeprom
-// init Audio+MIDI
+// start keyer and serial interrupts
+// (Audio and KeyerShield: see deferred_init)
 //
 //////////////////////////////////////////////////////////////////////////////
 
@@ -771,39 +1533,126 @@ void setup() {
 // Configure digital input (StraightKey, PaddleLeft, PaddleRight) and
 // digital output (CW1, CW2, PTT1, PTT2, TONEPIN) lines
 //
+#ifdef HWPROFILE
+  hw_init();       // all lines are taken from the hardware profile
+#endif
+
 #ifdef StraightKey
-  pinMode(StraightKey, INPUT_PULLUP);
+  if (HWPIN(StraightKey)) pinMode(StraightKey, INPUT_PULLUP);
 #endif
 
 #if defined(PaddleLeft) && defined(PaddleRight)
-  pinMode(PaddleLeft,  INPUT_PULLUP);
-  pinMode(PaddleRight, INPUT_PULLUP);
+  if (HWPIN(PaddleLeft))  pinMode(PaddleLeft,  INPUT_PULLUP);
+  if (HWPIN(PaddleRight)) pinMode(PaddleRight, INPUT_PULLUP);
 #endif
 
 #ifdef CW1
   // active-high CW output
-  pinMode(CW1, OUTPUT);
-  digitalWrite(CW1, LOW);
+  if (HWPIN(CW1)) {
+    pinMode(CW1, OUTPUT);
+    digitalWrite(CW1, LOW);
+  }
 #endif
 #ifdef CW2
   // active-low CW output
-  pinMode(CW2, OUTPUT);
-  digitalWrite(CW2, HIGH);
+  if (HWPIN(CW2)) {
+    pinMode(CW2, OUTPUT);
+    digitalWrite(CW2, HIGH);
+  }
 #endif
 #ifdef PTT1         // active-high PTT output
-  pinMode(PTT1, OUTPUT);
-  digitalWrite(PTT1, LOW);
+  if (HWPIN(PTT1)) {
+    pinMode(PTT1, OUTPUT);
+    digitalWrite(PTT1, LOW);
+  }
 #endif
 #ifdef PTT2         //active-low PTT output
-  pinMode(PTT2, OUTPUT);
-  digitalWrite(PTT2, HIGH);
+  if (HWPIN(PTT2)) {
+    pinMode(PTT2, OUTPUT);
+    digitalWrite(PTT2, HIGH);
+  }
 #endif
 #ifdef TONEPIN
-  pinMode(TONEPIN, OUTPUT);
-  digitalWrite(TONEPIN, LOW);
+  if (HWPIN(TONEPIN)) {
+    pinMode(TONEPIN, OUTPUT);
+    digitalWrite(TONEPIN, LOW);
+  }
+#endif
+
+#if defined(__AVR__) || defined(HWPROFILE)
+//
+// resolve port registers and bit masks for fastread/fastwrite
+//
+#ifdef StraightKey
+  fastpin_init(FP_STRAIGHT, StraightKey, 0);
+#endif
+#if defined(PaddleLeft) && defined(PaddleRight)
+  fastpin_init(FP_LEFT,  PaddleLeft,  0);
+  fastpin_init(FP_RIGHT, PaddleRight, 0);
+#endif
+#ifdef CW1
+  fastpin_init(FP_CW1, CW1, 1);
+#endif
+#ifdef CW2
+  fastpin_init(FP_CW2, CW2, 1);
+#endif
+#ifdef PTT1
+  fastpin_init(FP_PTT1, PTT1, 1);
+#endif
+#ifdef PTT2
+  fastpin_init(FP_PTT2, PTT2, 1);
+#endif
 #endif
 
   init_eeprom();
+  paddle_mode_select();
+
+#ifdef KEYER_ISR
+  //
+  // Start the keyer interrupt. Its priority is above USB and audio.
+  //
+  keyer_timer.priority(32);
+  keyer_timer.begin(keyer_tick, 1000000/KEYER_RATE);
+#endif
+#ifdef SERIAL_ISR
+  //
+  // Start the serial interrupt. Its priority is below USB,
+  // and below the keyer interrupt.
+  //
+  serial_timer.priority(128);
+  serial_timer.begin(serial_poll, 1000000/SERIAL_RATE);
+#endif
+
+  boot_keyer=millis();
+
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Deferred initialization
+//
+// setup() only does what is needed for keying (digital lines, settings from
+// the EEPROM, keyer and serial interrupts). The KeyerShield library, the
+// audio system and the codec are initialized afterwards, in the first pass
+// through loop(). The codec takes about half a second (mostly waiting for
+// its analog parts to power up).
+//
+// With KEYER_ISR, the paddle is sampled and the CW and PTT lines are keyed
+// while loop() is busy with this, so the keyer is live a few milli-seconds
+// after setup() has been entered. Events for the host (MIDI, echo) wait in
+// the event queue. Without KEYER_ISR, nothing is gained.
+//
+// The milli-second counts since reset when the keyer became live, when the
+// deferred initialization was complete and of the first key-down are kept
+// for ADMIN_XBOOTTIME (the variables are defined before setup()).
+//
+//////////////////////////////////////////////////////////////////////////////
+
+void deferred_init() {
+  static uint8_t done=0;
+
+  if (done) return;
+  done=1;
 
 #ifdef CWKEYERSHIELD
 
@@ -845,17 +1694,52 @@ AudioMemory(32);
 AudioNoInterrupts();
 
 sidetone.set_frequency(400);  // Initial setting (has no effect)
+#ifdef ZEROBEAT
+zerobeat_init();
+#endif
+#ifdef HWPROFILE
+//
+// The I2S output occupies some digital lines (7, 20, 21, 23),
+// so only create it if the hardware has a codec.
+//
+if (HW_AUDIO) {
+  i2s=new AudioOutputI2S;
+  sgtl5000.enable();       // Enable I2S output
+  sgtl5000.volume(0.40);   // SGTL master volume. Adjust to your hardware
+
+  (void) new AudioConnection(sidetone, 0, *i2s, 0);
+  (void) new AudioConnection(sidetone, 1, *i2s, 1);
+#ifdef ZEROBEAT
+  i2s_in=new AudioInputI2S;
+  sgtl5000.inputSelect(AUDIO_INPUT_LINEIN);
+  (void) new AudioConnection(*i2s_in, 0, zerobeat, 0);
+  (void) new AudioConnection(*i2s_in, 0, sidetone, 0);
+#endif
+}
+#else
 sgtl5000.enable();       // Enable I2S output
 sgtl5000.volume(0.40);   // SGTL master volume. Adjust to your hardware
 
 (void) new AudioConnection(sidetone, 0, i2s, 0);
 (void) new AudioConnection(sidetone, 1, i2s, 1);
+#ifdef ZEROBEAT
+sgtl5000.inputSelect(AUDIO_INPUT_LINEIN);
+(void) new AudioConnection(i2s_in, 0, zerobeat, 0);
+(void) new AudioConnection(i2s_in, 0, sidetone, 0);
+#endif
+#endif
+
+#ifdef USBTXAUDIO
+(void) new AudioConnection(sidetone, 2, usb_out, 0);
+(void) new AudioConnection(sidetone, 3, usb_out, 1);
+#endif
 
 AudioInterrupts();
 
 
 #endif  // TEENSY4AUDIO
 
+  boot_audio=millis();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -934,6 +1818,11 @@ void write_to_eeprom() {
     EEPROM.update(21, 0);      // default MsgPtr4
     EEPROM.update(22, 0);      // default MsgPtr5
     EEPROM.update(23, 0);      // default MsgPtr6
+#ifdef PROFILES
+    for (int i=0; i<PROFILES; i++) {
+      EEPROM.update(PROFILE_BASE+PROFILE_SIZE*i, 0);  // mark settings profiles as empty
+    }
+#endif
 }
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -950,8 +1839,275 @@ void init_eeprom() {
   } else {
     write_to_eeprom();
   }
+#ifdef PROFILES
+  read_profiles();
+#endif
 }
 
+#ifdef PROFILES
+//////////////////////////////////////////////////////////////////////////////
+//
+// Settings profiles
+//
+// PROFILES complete sets of the settings (ModeRegister ... PinConfig) are
+// stored in the EEPROM *behind* the 256 bytes of the K1EL layout, so they
+// are neither reported nor overwritten by the DUMP/LOAD EEPROM commands.
+// Profiles are numbered 1, 2, ... PROFILES.
+//
+// ADDR                     Explanation
+// ===========================================================
+// 256+16*(n-1)             Magic byte (0xA5) if profile n is valid
+// 257+16*(n-1) ... +14     settings, same order as in addr 1-14
+// 271+16*(n-1)             unused
+//
+// All profiles are cached in RAM upon startup, such that switching to
+// another profile only copies 14 bytes. It is then in effect until the
+// EEPROM settings are re-loaded (reset, host close), the profile switch
+// is not written to EEPROM.
+//
+// Switching is done with the ADMIN_XPROFILE command, or by a long press
+// of one of the push-buttons (if there is a push-button array).
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(E2END) && (PROFILE_BASE + PROFILES*PROFILE_SIZE > E2END+1)
+#error "EEPROM too small for the number of settings profiles"
+#endif
+
+static uint8_t profile[PROFILES][PROFILE_SIZE];
+
+void read_profiles() {
+  int i,j;
+  for (i=0; i<PROFILES; i++) {
+    for (j=0; j<PROFILE_SIZE; j++) {
+      profile[i][j]=EEPROM.read(PROFILE_BASE + PROFILE_SIZE*i + j);
+    }
+  }
+}
+
+void select_profile(int n) {
+  uint8_t *p;
+
+  if (n < 1 || n > PROFILES) return;
+  p=profile[n-1];
+  if (p[0] != MAGIC) return;         // empty profile slot
+
+  ModeRegister = p[ 1];
+  if (p[2] >= 5 && p[2] <= 65) {
+    Speed=p[2];
+    if (HostSpeed != 0) {
+      HostSpeed=p[2];
+#ifdef CWKEYERSHIELD
+      cwshield.cwspeed(HostSpeed);
+#endif
+    }
+  }
+  Sidetone     = p[ 3];
+  Weight       = p[ 4];
+  LeadIn       = p[ 5];
+  Tail         = p[ 6];
+  MinWPM       = p[ 7];
+  WPMrange     = p[ 8];
+  Extension    = p[ 9];
+  Compensation = p[10];
+  Farnsworth   = p[11];
+  PaddlePoint  = p[12];
+  Ratio        = p[13];
+  PinConfig    = p[14];
+}
+
+void store_profile(int n) {
+  uint8_t *p;
+  int i;
+
+  if (n < 1 || n > PROFILES) return;
+  p=profile[n-1];
+
+  p[ 0] = MAGIC;
+  p[ 1] = ModeRegister;
+  p[ 2] = (HostSpeed != 0) ? HostSpeed : Speed;
+  p[ 3] = Sidetone;
+  p[ 4] = Weight;
+  p[ 5] = LeadIn;
+  p[ 6] = Tail;
+  p[ 7] = MinWPM;
+  p[ 8] = WPMrange;
+  p[ 9] = Extension;
+  p[10] = Compensation;
+  p[11] = Farnsworth;
+  p[12] = PaddlePoint;
+  p[13] = Ratio;
+  p[14] = PinConfig;
+  p[15] = 0;
+
+  for (i=0; i<PROFILE_SIZE; i++) {
+    EEPROM.update(PROFILE_BASE + PROFILE_SIZE*(n-1) + i, p[i]);
+  }
+}
+#endif
+
+#ifdef HWPROFILE
+//////////////////////////////////////////////////////////////////////////////
+//
+// Hardware profile
+//
+// With HWPROFILE, one firmware image serves different Teensy 4 hardware.
+// The digital and analog lines, and whether MIDI messages are sent and
+// an SGTL5000 codec is present, are read from the EEPROM upon startup.
+// The ADMIN_XHWPROFILE command stores one of the presets below there;
+// it takes effect with the next reset.
+//
+// ADDR                     Explanation
+// ===========================================================
+// 1024                     Magic byte (0xA5) if valid
+// 1025 ... 1034            PaddleLeft, PaddleRight, StraightKey, CW1, CW2,
+//                          PTT1, PTT2, TONEPIN, POTPIN, BUTTONPIN
+//                          (255 = not used)
+// 1035                     bit0: MIDI, bit1: audio (SGTL5000)
+// 1036 ... 1039            unused
+//
+// Without a valid profile, preset 0 is used, which has no digital
+// or analog lines at all.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#define HWPROFILE_BASE 1024
+
+#if defined(E2END) && (HWPROFILE_BASE + HWPROFILE_SIZE > E2END+1)
+#error "EEPROM too small for the hardware profile"
+#endif
+#if defined(PROFILES) && (PROFILE_BASE + PROFILES*PROFILE_SIZE > HWPROFILE_BASE)
+#error "settings profiles overlap with the hardware profile"
+#endif
+
+#define HW_PRESETS 3
+static const uint8_t hw_preset[HW_PRESETS][HW_SINKS+1] = {
+  //       Left   Right  Straight CW1    CW2    PTT1   PTT2   TONE   POT    BUTTON Sinks
+  // 0: like config.teensy4_bare.h
+  { MAGIC, NOPIN, NOPIN, NOPIN,   NOPIN, NOPIN, NOPIN, NOPIN, NOPIN, NOPIN, NOPIN, 0x01 },
+  // 1: like config.teensy4_sgtl5000.h
+  { MAGIC, 2,     1,     0,       5,     NOPIN, 4,     NOPIN, NOPIN, A2,    NOPIN, 0x03 },
+  // 2: like config.teensy.h, but WinKey protocol via USB
+  { MAGIC, 3,     2,     4,       6,     NOPIN, 7,     NOPIN, 10,    A6,    A8,    0x01 },
+};
+
+void hw_init() {
+  int i;
+
+  for (i=0; i<HWPROFILE_SIZE; i++) {
+    hwprofile[i]=EEPROM.read(HWPROFILE_BASE + i);
+  }
+  if (hwprofile[HW_MAGIC] != MAGIC) {
+    memset(hwprofile, NOPIN, HWPROFILE_SIZE);
+    memcpy(hwprofile, hw_preset[0], HW_SINKS+1);
+  }
+}
+
+void hw_store(int n) {
+  int i;
+
+  if (n < 0 || n >= HW_PRESETS) return;
+  for (i=0; i<HWPROFILE_SIZE; i++) {
+    EEPROM.update(HWPROFILE_BASE + i, i <= HW_SINKS ? hw_preset[n][i] : NOPIN);
+  }
+}
+#endif
+
+#ifdef ZEROBEAT
+//////////////////////////////////////////////////////////////////////////////
+//
+// Zero-beat analyzer, part 2: find the CW tone in the RX audio
+//
+// The collected audio (93 msec) gets a Hann window and a real FFT. The
+// strongest bin between ZB_FMIN and ZB_FMAX is taken if it stands out
+// clearly, and a parabola through the logarithm of this and the two
+// neighbouring bins gives the frequency to about 1 Hz.
+// The result is discarded if our own key was down while collecting.
+// The FFT (some 30 usec on a Teensy 4) runs in loop() at most four times
+// per second, so the audio update only has to do the collecting.
+//
+// zb_mode 0: off, 1: measure, 2: measure and set the side tone frequency
+// The offset (CW tone minus side tone) is reported with ADMIN_XZBOFFSET.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+static uint8_t  zb_mode=1;              // see above
+static uint8_t  zb_keyed=0;             // set in keydown()
+static uint16_t zb_freq=0;              // CW tone frequency (Hz), 0 if none found
+static tick_t zb_next=0;                // time of next analysis
+static arm_rfft_fast_instance_f32 zb_fft;
+static float zb_window[ZB_N];
+static float zb_spec[ZB_N];
+
+void zerobeat_init() {
+  int i;
+
+  arm_rfft_fast_init_f32(&zb_fft, ZB_N);
+  for (i=0; i<ZB_N; i++) {
+    zb_window[i]=0.5f - 0.5f*cosf(2.0f*(float) PI*i/ZB_N);
+  }
+}
+
+//
+// power of FFT bin k (zb_spec holds DC, Nyquist, then re/im pairs)
+//
+float zb_power(int k) {
+  float re=zb_spec[2*k];
+  float im=zb_spec[2*k+1];
+  return re*re + im*im + 1.0E-20f;
+}
+
+void zerobeat_poll() {
+  int k, kmax, klo, khi;
+  float p, pmax, psum, a, b, c, d;
+  float *x;
+
+  if (!zerobeat.ready() || !REACHED(zb_next)) return;
+
+  if (zb_mode == 0 || zb_keyed || ptt_stat) {
+    zb_keyed=0;
+    zerobeat.restart();
+    return;
+  }
+
+  x=zerobeat.data;
+  for (k=0; k<ZB_N; k++) {
+    x[k] *= zb_window[k];
+  }
+  arm_rfft_fast_f32(&zb_fft, x, zb_spec, 0);
+  zerobeat.restart();
+  zb_next=actual+ZB_INTERVAL;
+
+  klo=ZB_FMIN*ZB_N/ZB_RATE;
+  khi=ZB_FMAX*ZB_N/ZB_RATE;
+  kmax=klo;
+  pmax=psum=0.0f;
+  for (k=klo; k<=khi; k++) {
+    p=zb_power(k);
+    psum += p;
+    if (p > pmax) {
+      pmax=p;
+      kmax=k;
+    }
+  }
+  if (pmax < ZB_SNR*psum/(khi-klo+1)) {
+    zb_freq=0;
+    return;
+  }
+
+  a=logf(zb_power(kmax-1));
+  b=logf(zb_power(kmax));
+  c=logf(zb_power(kmax+1));
+  d=0.5f*(a-c)/(a-2.0f*b+c);
+  zb_freq=(kmax+d)*ZB_RATE/ZB_N + 0.5f;
+
+  if (zb_mode == 2 && (zb_freq > myfreq+4 || zb_freq+4 < myfreq)) {
+    myfreq=zb_freq;
+    sidetone.set_frequency(myfreq);
+  }
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Some utility functions when using MIDI
@@ -963,6 +2119,9 @@ void init_eeprom() {
 //
 void SendOnOff(int chan, int note, int state) {
   if (chan < 0 || note < 0) return;
+#ifdef HWPROFILE
+  if (!HW_MIDI) return;
+#endif
   chan = chan & 0x0F;
   if (state) {
     usbMIDI.sendNoteOn(note, 127, chan);
@@ -974,6 +2133,9 @@ void SendOnOff(int chan, int note, int state) {
 
 void SendControlChange(int chan, int control, int val) {
   if (chan < 0 || control < 0) return;
+#ifdef HWPROFILE
+  if (!HW_MIDI) return;
+#endif
   usbMIDI.sendControlChange(control, val, chan);
   usbMIDI.send_now();
 }
@@ -1053,17 +2215,159 @@ void DrainMIDI() {
 #endif
 }
 
+#ifdef SERIAL_ISR
+//////////////////////////////////////////////////////////////////////////////
+//
+// With SERIAL_ISR, bytes from the host are fetched from the serial port
+// in a timer interrupt (the Teensy core offers no hook into the USB
+// receive interrupt, so it is polled at SERIAL_RATE Hz) and put into a
+// lock-free staging queue from which the WinKey state machine reads them.
+//
+// The interrupt also follows the command structure of the byte stream
+// (without interpreting it otherwise) so that "break-in" commands take
+// effect immediately rather than when the WinKey state machine reaches
+// them:
+//
+// - CLEAR: the keyer is told to discard its buffer at its next tick, and
+//          text and buffered commands that precede the CLEAR in the staging
+//          queue are discarded when the WinKey state machine reads them.
+//          POINTER sub-command 0 (clear buffer) is treated the same way.
+// - PAUSE: the pause state is set immediately
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// number of argument bytes following a (non-ADMIN, non-POINTER) command
+//
+uint16_t wk_arglen(uint8_t cmd) {
+  switch (cmd) {
+    case GETPOT: case BACKSPACE: case CLEAR: case NULLCMD:
+    case WKSTAT: case CANCELSPD: case BUFNOP:
+      return 0;
+    case PTT: case PROSIGN:
+      return 2;
+    case POTSET:
+      return 3;
+    case LOADDEF:
+      return 15;
+    default:
+      return 1;
+  }
+}
+
+//
+// number of argument bytes following an ADMIN sub-command
+//
+uint16_t wk_adminlen(uint8_t cmd) {
+  switch (cmd) {
+    case ADMIN_CALIBRATE: case ADMIN_ECHO: case ADMIN_SENDMSG:
+    case ADMIN_LOADX1: case ADMIN_LOADX2: case ADMIN_VOLUME:
+    case ADMIN_XPROFILE: case ADMIN_XSVPROFILE: case ADMIN_XHWPROFILE:
+    case ADMIN_XZEROBEAT: case ADMIN_XBREAKIN: case ADMIN_XMIDIPAD:
+      return 1;
+    case ADMIN_RTTY: case ADMIN_XVOLUME:
+      return 2;
+    case ADMIN_LOADEEPROM:
+      return 256;
+    default:
+      return 0;
+  }
+}
+
+//
+// follow the command structure, and act on break-in commands
+//
+void serial_scan(uint8_t byte, uint8_t pos) {
+  static uint16_t skip=0;        // argument bytes still to come
+  static uint8_t  sub=0;         // 1: ADMIN, 2: POINTER, 3: PAUSE argument expected
+  static uint8_t  host=0;        // shadow of "hostmode"
+
+  if (skip) {
+    skip--;
+    if (skip == 0 && sub == 3) {
+      pausing=byte;
+      sub=0;
+    }
+    return;
+  }
+  switch (sub) {
+    case 1:
+      sub=0;
+      if (byte == ADMIN_OPEN)  host=1;
+      if (byte == ADMIN_CLOSE) host=0;
+      if (byte == ADMIN_RESET) host=0;
+      skip=wk_adminlen(byte);
+      return;
+    case 2:
+      sub=0;
+      if (byte >= 1 && byte <= 3) skip=1;
+      if (byte == 0) {
+        clear_request=1;
+        serclear=pos+1;
+        serclearpend=1;
+      }
+      return;
+  }
+  if (byte == ADMIN) {
+    sub=1;
+    return;
+  }
+  if (!host || byte >= 0x20) return;
+  switch (byte) {
+    case POINTER:
+      sub=2;
+      break;
+    case CLEAR:
+      clear_request=1;
+      serclear=pos+1;
+      serclearpend=1;
+      break;
+    case PAUSE:
+      sub=3;
+      skip=1;
+      break;
+    default:
+      skip=wk_arglen(byte);
+      break;
+  }
+}
+
+void serial_poll() {
+  uint8_t tx=sertx;
+  uint8_t byte;
+  while ((uint8_t) (tx + 1) != serrx && MYSERIAL.available()) {
+    byte=MYSERIAL.read();
+    serbuf[tx]=byte;
+    serial_scan(byte, tx);
+    sertx=++tx;
+  }
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Read one byte from host.
-// If not using the serial line, this always returns 0.
+// If not using the serial line, or if no byte is available (see
+// ByteAvailable), this returns 0.
 //
 //////////////////////////////////////////////////////////////////////////////
 
 int FromHost() {
   int c=0;
+#ifdef SERIAL_ISR
+  uint8_t rx=serrx;
+  if (rx == sertx) return 0;
+  c=serbuf[rx++];
+  noInterrupts();
+  serdiscard=serclearpend;           // byte received before a pending CLEAR
+  if (rx == serclear) serclearpend=0;
+  serrx=rx;
+  interrupts();
+#else
 #ifdef MYSERIAL
   c=MYSERIAL.read();
+  if (c < 0) c=0;
+#endif
 #endif
 
   return c;
@@ -1091,12 +2395,122 @@ void ToHost(int c) {
 
 int ByteAvailable() {
   int rc=0;
+#ifdef SERIAL_ISR
+  rc=(uint8_t) (sertx - serrx);
+#else
 #ifdef MYSERIAL
   rc=MYSERIAL.available();
+#endif
 #endif
   return rc;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Keyer events: MIDI messages and KeyerShield calls upon key-down/up and
+// PTT on/off, speed changes, and bytes sent to the host (echo).
+//
+// Normally these are executed immediately. If the keyer runs in an
+// interrupt (KEYER_ISR), it must not touch the USB stack, so the events
+// are put into a queue which is drained in loop(). The queue is written
+// by the keyer interrupt, and by loop() only with the keyer interrupt
+// blocked (LOCK_KEYER), as TUNE does when it calls keydown(), keyup(),
+// ptt_on() or ptt_off() from loop(), and paddle_mode_select() for the
+// MIDI_PADDLES catch-up events.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+enum KEVENT {
+  EV_KEY,         // key-down/up
+  EV_PTT,         // PTT on/off
+  EV_SPEED,       // keyer speed changed
+  EV_TOHOST,      // byte to be sent to the host
+  EV_DOT,         // dot paddle contact (MIDI_PADDLES)
+  EV_DASH,        // dash paddle contact (MIDI_PADDLES)
+  EV_STRAIGHT     // straight key contact (MIDI_PADDLES)
+};
+
+void do_event(uint8_t ev, uint8_t val) {
+  switch (ev) {
+    case EV_KEY:
+      SendOnOff(MY_MIDI_CHANNEL, MY_KEYDOWN_NOTE, val);
+#ifdef CWKEYERSHIELD                               // MIDI and side tone
+      cwshield.key(val);
+#endif
+      break;
+    case EV_PTT:
+      SendOnOff(MY_MIDI_CHANNEL, MY_PTT_NOTE, val);
+#ifdef CWKEYERSHIELD
+      cwshield.cwptt(val);
+#endif
+      break;
+    case EV_SPEED:
+      SendControlChange(MY_MIDI_CHANNEL, MY_SPEED_CTL, val);
+      break;
+    case EV_TOHOST:
+      ToHost(val);
+      break;
+    case EV_DOT:
+      SendOnOff(MY_MIDI_CHANNEL, MY_DOT_NOTE, val);
+      break;
+    case EV_DASH:
+      SendOnOff(MY_MIDI_CHANNEL, MY_DASH_NOTE, val);
+      break;
+    case EV_STRAIGHT:
+      SendOnOff(MY_MIDI_CHANNEL, MY_STRAIGHT_NOTE, val);
+      break;
+  }
+}
+
+#ifdef KEYER_ISR
+#define EVLEN 64       // size of event queue, power of two
+
+static volatile uint8_t evtype[EVLEN];
+static volatile uint8_t evval[EVLEN];
+static volatile uint8_t evrx=0;
+static volatile uint8_t evtx=0;
+
+void post_event(uint8_t ev, uint8_t val) {
+  uint8_t tx=evtx;
+  if ((uint8_t) (tx - evrx) >= EVLEN) return;   // queue full: drop event
+  evtype[tx & (EVLEN-1)]=ev;
+  evval [tx & (EVLEN-1)]=val;
+  evtx=tx+1;
+}
+
+void drain_events() {
+  uint8_t rx=evrx;
+  while (rx != evtx) {
+    do_event(evtype[rx & (EVLEN-1)], evval[rx & (EVLEN-1)]);
+    evrx=++rx;
+  }
+}
+#else
+#define post_event(ev, val) do_event(ev, val)
+#endif
+
+#ifdef USBTXAUDIO
+//////////////////////////////////////////////////////////////////////////////
+//
+// Time stamp of a key change for the USB audio stream (see SideToneSource):
+// micros(), or with AUDIOCLOCK a sample index. A change scheduled by the
+// keyer state machine is placed at its deadline, not at the time the
+// deadline has been noticed.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#define CLOCK_MARGIN 1          // msec, see SideToneSource
+
+uint32_t key_stamp() {
+#ifdef AUDIOCLOCK
+  if (key_edge_valid) return sidetone.ms_to_sample(key_edge + CLOCK_MARGIN);
+  return (uint32_t) sidetone.sample_now() + (uint32_t) (CLOCK_MARGIN * AUDIO_SAMPLE_RATE_EXACT / 1000);
+#else
+  return micros();
+#endif
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // "key down" action
@@ -1106,29 +2520,36 @@ int ByteAvailable() {
 void keydown() {
   if (cw_stat) return;
   cw_stat=1;
+  if (!boot_keyed) {
+    boot_firstkey=millis();
+    boot_keyed=1;
+  }
   //
   // Actions: side tone on (if enabled), set hardware line(s), send MIDI  message
   //
 #ifdef TONEPIN
-  tone(TONEPIN, myfreq);
+  if (HWPIN(TONEPIN)) tone(TONEPIN, myfreq);
 #endif
 
 #ifdef CW1                                              // active-high CW output
-  digitalWrite(CW1,HIGH);
+  if (!RTTY_ACTIVE) fastwrite(FP_CW1,CW1,HIGH);
 #endif
 
 #ifdef CW2                                              //active-low CW line
-  digitalWrite(CW2,LOW);
+  if (!RTTY_ACTIVE) fastwrite(FP_CW2,CW2,LOW);
 #endif
 
-  SendOnOff(MY_MIDI_CHANNEL, MY_KEYDOWN_NOTE, 1);
+  post_event(EV_KEY, 1);                                // MIDI, KeyerShield
 
-#ifdef CWKEYERSHIELD                               // MIDI and sidetone
- cwshield.key(1);
-#endif
 #ifdef TEENSY4AUDIO
   if (SIDETONE_ENABLED) sidetone.onoff(1);
 #endif
+#ifdef USBTXAUDIO
+  sidetone.key(1, key_stamp());
+#endif
+#ifdef ZEROBEAT
+  zb_keyed=1;
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1145,25 +2566,25 @@ void keyup() {
   //
 
 #ifdef TONEPIN
-  noTone(TONEPIN);
+  if (HWPIN(TONEPIN)) noTone(TONEPIN);
 #endif
 
 #ifdef CW1                                              // active-high CW output
-  digitalWrite(CW1,LOW);
+  if (!RTTY_ACTIVE) fastwrite(FP_CW1,CW1,LOW);
 #endif
 
 #ifdef CW2
-  digitalWrite(CW2,HIGH);                               // active-low CW output
+  if (!RTTY_ACTIVE) fastwrite(FP_CW2,CW2,HIGH);          // active-low CW output
 #endif
 
-  SendOnOff(MY_MIDI_CHANNEL, MY_KEYDOWN_NOTE, 0);
+  post_event(EV_KEY, 0);                                // MIDI, KeyerShield
 
-#ifdef CWKEYERSHIELD                               // MIDI and side tone
- cwshield.key(0);
-#endif
 #ifdef TEENSY4AUDIO
   sidetone.onoff(0);
 #endif
+#ifdef USBTXAUDIO
+  sidetone.key(0, key_stamp());
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1179,19 +2600,14 @@ void ptt_on() {
   // Actions: raise hardware line, send MIDI NoteOn message
   //
 #ifdef PTT1                                               // active high PTT line
-  digitalWrite(PTT1,HIGH);
+  fastwrite(FP_PTT1,PTT1,HIGH);
 #endif
 
 #ifdef PTT2                                               // active low PTT line
-  digitalWrite(PTT2,LOW);
+  fastwrite(FP_PTT2,PTT2,LOW);
 #endif
 
-
-  SendOnOff(MY_MIDI_CHANNEL, MY_PTT_NOTE, 1);
-
-#ifdef CWKEYERSHIELD
-  cwshield.cwptt(1);
-#endif
+  post_event(EV_PTT, 1);                                  // MIDI, KeyerShield
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1207,19 +2623,172 @@ void ptt_off() {
   // Actions: drop hardware line, send MIDI NoteOff message
   //
 #ifdef PTT1
-  digitalWrite(PTT1,LOW);                                 // active high PTT line
+  fastwrite(FP_PTT1,PTT1,LOW);                           // active high PTT line
 #endif
 
 #ifdef PTT2
-  digitalWrite(PTT2,HIGH);                                // active low PTT line
+  fastwrite(FP_PTT2,PTT2,HIGH);                          // active low PTT line
 #endif
 
-  SendOnOff(MY_MIDI_CHANNEL, MY_PTT_NOTE, 0);
+  post_event(EV_PTT, 0);                                  // MIDI, KeyerShield
+}
 
-#ifdef CWKEYERSHIELD
-  cwshield.cwptt(0);
+#ifdef RTTY
+//////////////////////////////////////////////////////////////////////////////
+//
+// RTTY (FSK)
+//
+// WK3.1-style RTTY, with these RTTY registers (ADMIN_RTTY <r1> <r2>):
+//
+// r1 bit 7:    RTTY mode on (0: CW)
+// r1 bits 1-0: 0 = 45.45 baud, 1 = 50 baud, 2 = 75 baud, 3 = 100 baud
+// r1 bit 2:    reverse (mark = CW line active)
+// r1 bit 3:    unshift on space (USOS)
+// r1 bit 4:    2 stop bits (default: 1.5)
+// r2:          not used
+//
+// The timer interrupt runs at twice the baud rate, each tick puts one
+// half-bit on the CW lines, so the bit edges are as exact as the timer
+// (no millisecond scheduler involved). A character is 2 half-bits start
+// (space), 10 data (5 bits, LSB first) and 3 or 4 stop (mark). Idle is mark,
+// which is "key up" unless reversed.
+//
+// Characters come from the character buffer, as in CW, see SNDRTTY in the
+// keyer state machine, and are converted to Baudot (US TTY): lower case
+// is converted to upper case, "|" is sent as CR LF, characters without a
+// Baudot code are skipped. The paddle and straight key break in as in CW,
+// but do not key the CW lines in RTTY mode.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#define BAUDOT_LTRS 0x1F
+#define BAUDOT_FIGS 0x1B
+
+static const uint8_t baudot_letters[26] = {
+  0x03, 0x19, 0x0E, 0x09, 0x01, 0x0D, 0x1A, 0x14, 0x06, 0x0B, 0x0F, 0x12, 0x1C,  // A-M
+  0x0C, 0x18, 0x16, 0x17, 0x0A, 0x05, 0x10, 0x07, 0x1E, 0x13, 0x1D, 0x15, 0x11   // N-Z
+};
+
+//
+// figures shift (US TTY), indexed by Baudot code (0: none).
+// FIGS+S is BELL in US TTY, the apostrophe is FIGS+J.
+//
+static const char baudot_figures[32] = {
+    0,  '3',    0,  '-',    0,    0,  '8',  '7',    0,  '$',  '4', '\'', ',',  '!',  ':',  '(',
+  '5', '"',  ')',  '2',  '#',  '6',  '0',  '1',  '9',  '?',  '&',    0,  '.',  '/',  ';',    0
+};
+
+void rtty_line(uint8_t mark) {
+  uint8_t active = mark ^ 1 ^ ((rtty_reg1 >> 2) & 1);
+#ifdef CW1
+  fastwrite(FP_CW1,CW1,active ? HIGH : LOW);
+#endif
+#ifdef CW2
+  fastwrite(FP_CW2,CW2,active ? LOW : HIGH);
+#endif
+}
+
+void rtty_tick() {
+  uint8_t n=rtty_nbits;
+  if (n == 0) {
+    uint8_t rx=rtty_qrx;
+    uint8_t code;
+    if (rx == rtty_qtx) return;           // idle (mark)
+    code=rtty_q[rx & (RTTY_QLEN-1)];
+    rtty_qrx=rx+1;
+    //
+    // half-bits, LSB first: start, 5 data bits, stop
+    //
+    uint16_t b=0xF000;
+    for (int i=0; i<5; i++) {
+      if (code & (1 << i)) b |= 3 << (2+2*i);
+    }
+    rtty_bits=b;
+    n=(rtty_reg1 & 0x10) ? 16 : 15;
+  }
+  rtty_line(rtty_bits & 1);
+  rtty_bits >>= 1;
+  rtty_nbits=n-1;
+}
+
+uint8_t rtty_room() {
+  return RTTY_QLEN - (uint8_t)(rtty_qtx - rtty_qrx);
+}
+
+uint8_t rtty_idle() {
+  return rtty_qtx == rtty_qrx && rtty_nbits == 0;
+}
+
+void rtty_code(uint8_t code) {
+  uint8_t tx=rtty_qtx;
+  rtty_q[tx & (RTTY_QLEN-1)]=code;
+  rtty_qtx=tx+1;
+}
+
+//
+// Queue an ASCII character (shift code included if needed).
+// The caller makes sure there is room for two codes.
+// Returns 0 if there is no Baudot code for this character.
+//
+uint8_t rtty_put(uint8_t c) {
+  if (c >= 'a' && c <= 'z') c -= 32;
+  if (c == ' ') {
+    rtty_code(0x04);
+    if (rtty_reg1 & 0x08) rtty_figs=0;  // USOS: the receiver falls back to letters
+    return 1;
+  }
+  if (c == '|') {
+    rtty_code(0x08);                    // CR
+    rtty_code(0x02);                    // LF
+    return 1;
+  }
+  if (c >= 'A' && c <= 'Z') {
+    if (rtty_figs) {
+      rtty_code(BAUDOT_LTRS);
+      rtty_figs=0;
+    }
+    rtty_code(baudot_letters[c-'A']);
+    return 1;
+  }
+  for (uint8_t i=0; i<32; i++) {
+    if (baudot_figures[i] == c && c != 0) {
+      if (!rtty_figs) {
+        rtty_code(BAUDOT_FIGS);
+        rtty_figs=1;
+      }
+      rtty_code(i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//
+// Apply the RTTY registers: start or stop the FSK interrupt
+//
+void rtty_setup() {
+  static const float halfbit[4]={1000000.0/(2*45.45), 1000000.0/(2*50),
+                                 1000000.0/(2*75),    1000000.0/(2*100)};
+  rtty_timer.end();
+  rtty_qrx=rtty_qtx;
+  rtty_nbits=0;
+  if (rtty_reg1 & 0x80) {
+    rtty_figs=1;                        // send LTRS before the first letter
+    rtty_on=1;
+    rtty_line(1);
+    rtty_timer.priority(16);            // above the keyer interrupt
+    rtty_timer.begin(rtty_tick, halfbit[rtty_reg1 & 3]);
+  } else {
+    rtty_on=0;
+#ifdef CW1
+    fastwrite(FP_CW1,CW1,LOW);          // CW lines: key up
 #endif
+#ifdef CW2
+    fastwrite(FP_CW2,CW2,HIGH);
+#endif
+  }
 }
+#endif
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1228,32 +2797,110 @@ void ptt_off() {
 //////////////////////////////////////////////////////////////////////////////
 
 void clearbuf() {
-  bufrx=buftx=bufcnt=0;
+  LOCK_KEYER;
+  bufrx=buftx=0;
+  bufbase=0;
+  bufovr=0;
   pausing=0;
   BufSpeed=0;
+#ifdef BREAKIN_RESUME
+  breakin_paused=0;
+#endif
+  UNLOCK_KEYER;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Overwrite mode: write one character at bufwr. If it has already been
+// sent, it is lost, and if bufwr has reached the end of the buffer, we
+// return to normal (append) mode. Called with the keyer interrupt blocked.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+void bufoverwrite(uint8_t c) {
+  if ((uint8_t)(bufwr - bufbase) >= (uint8_t)(bufrx - bufbase)) {
+    character_buffer[bufwr & (BUFLEN-1)]=c;
+  }
+  bufwr++;
+  if ((uint8_t)(bufwr - bufbase) >= (uint8_t)(buftx - bufbase)) {
+    buftx=bufwr;   // may have written past the end
+    bufovr=0;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Advance bufbase by BUFLEN once BUFLEN characters beyond it have been
+// sent. Positions relative to bufbase then stay below 2*BUFLEN, even if
+// the buffer never runs empty. Not used in overwrite mode, where bufwr
+// may lag behind bufrx.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+void bufbase_advance() {
+  if ((uint8_t)(bufrx - bufbase) >= BUFLEN) bufbase += BUFLEN;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Insert zeroes, for pointer commands
+// Insert zeroes, for pointer commands. These are place-holders that can
+// later be overwritten, the keyer skips them. In append mode, they are
+// all queued at once (as many as fit).
 //
 //////////////////////////////////////////////////////////////////////////////
 
 void bufzero(int len) {
+  uint8_t tx;
+#ifdef SERIAL_ISR
+  if (serdiscard) return;    // command preceding a CLEAR command
+#endif
+  if (bufovr) {
+    LOCK_KEYER;
+    while (bufovr && len > 0) {
+      bufoverwrite(0);
+      len--;
+    }
+    UNLOCK_KEYER;
+  }
+  if (len > BUFLEN - bufcount()) len=BUFLEN - bufcount();
+  if (len <= 0) return;
+  bufbase_advance();
+  tx=buftx;
+  if (tx == bufrx) bufbase=tx;
   while (len--) {
-    queue(1,0,0,0);
+    character_buffer[tx++ & (BUFLEN-1)]=0;
   }
+  buftx=tx;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Set buffer pointer to ABSOLUTE position
-// for pointer commands
+// Set buffer pointer to position pos (relative to bufbase)
+// for pointer commands. Positions beyond the end of the buffer
+// address the end of the buffer.
+// mode=1: overwrite mode, the buffer contents is kept
+// mode=2: append mode, the buffer is truncated at pos
 //
 //////////////////////////////////////////////////////////////////////////////
 
-void setbufpos(int pos) {
-  buftx=pos;
+void setbufpos(int pos, int mode) {
+  uint8_t len;
+#ifdef SERIAL_ISR
+  if (serdiscard) return;    // command preceding a CLEAR command
+#endif
+  LOCK_KEYER;
+  bufbase_advance();
+  len=buftx - bufbase;
+  if (pos > len) pos=len;
+  if (mode == 1) {
+    bufwr=bufbase+pos;
+    bufovr=(pos < len);
+  } else {
+    if (pos < (uint8_t)(bufrx - bufbase)) pos=bufrx - bufbase;   // already sent
+    buftx=bufbase+pos;
+    bufovr=0;
+  }
+  UNLOCK_KEYER;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1264,15 +2911,46 @@ void setbufpos(int pos) {
 //////////////////////////////////////////////////////////////////////////////
 
 void queue(int n, int a, int b, int c) {
-  if (bufcnt + n > BUFLEN) return;
-  character_buffer[buftx++]=a; if (buftx >= BUFLEN) buftx=0; bufcnt++;
+  uint8_t tx=buftx;
+#ifdef SERIAL_ISR
+  if (serdiscard) return;    // text preceding a CLEAR command
+#endif
+  if (bufovr) {
+    LOCK_KEYER;
+    if (bufovr) {
+      bufoverwrite(a);
+      if (n > 1) queue_tail(b);
+      if (n > 2) queue_tail(c);
+      UNLOCK_KEYER;
+      return;
+    }
+    UNLOCK_KEYER;
+    tx=buftx;
+  }
+  if (bufcount() + n > BUFLEN) return;
+  bufbase_advance();
+  if (tx == bufrx) bufbase=tx;
+  character_buffer[tx++ & (BUFLEN-1)]=a;
   if (n > 1) {
-    character_buffer[buftx++]=b; if (buftx >= BUFLEN) buftx=0; bufcnt++;
+    character_buffer[tx++ & (BUFLEN-1)]=b;
   }
   if (n > 2) {
-    character_buffer[buftx++]=c; if (buftx >= BUFLEN) buftx=0; bufcnt++;
+    character_buffer[tx++ & (BUFLEN-1)]=c;
+  }
+  buftx=tx;   // all n bytes become visible to the keyer at once
+}
+
+//
+// helper for queue(): further bytes of a multi-byte sequence in overwrite mode,
+// called with the keyer interrupt blocked.
+//
+void queue_tail(uint8_t c) {
+  if (bufovr) {
+    bufoverwrite(c);
+  } else if (bufcount() < BUFLEN) {
+    character_buffer[buftx & (BUFLEN-1)]=c;
+    buftx++;
   }
-  if (bufcnt > BUFMARGIN) WKstatus |= 0x01;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1282,11 +2960,13 @@ void queue(int n, int a, int b, int c) {
 //////////////////////////////////////////////////////////////////////////////
 
 void backspace() {
-  if (bufcnt < 1) return;
-  buftx--;
-  if (buftx < 0) buftx=BUFLEN-1;
-  bufcnt--;
-  if (bufcnt <= BUFMARGIN) WKstatus &= 0xFE;
+#ifdef SERIAL_ISR
+  if (serdiscard) return;    // command preceding a CLEAR command
+#endif
+  LOCK_KEYER;
+  if (bufcount() > 0) buftx--;
+  if (bufovr && (uint8_t)(bufwr - bufbase) >= (uint8_t)(buftx - bufbase)) bufovr=0;
+  UNLOCK_KEYER;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1297,11 +2977,10 @@ void backspace() {
 
 int FromBuffer() {
   int c;
-  if (bufcnt < 1) return 0;
-  c=character_buffer[bufrx++];
-  if (bufrx >= BUFLEN) bufrx=0;
-  bufcnt--;
-  if (bufcnt <= BUFMARGIN) WKstatus &= 0xFE;
+  uint8_t rx=bufrx;
+  if (rx == buftx) return 0;
+  c=character_buffer[rx & (BUFLEN-1)];
+  bufrx=rx+1;
   return c;
 }
 
@@ -1395,62 +3074,40 @@ uint8_t Morse_to_ASCII(int m) {
   return 32; // notfound: return a space
 }
 
-///////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
 //
-// This is the Keyer state machine
+// Compute the element and pause lengths from the current settings.
 //
-///////////////////////////////////////
-
-void keyer_state_machine() {
-  int i;                        // general counter variable
-  uint8_t byte;                 // general one-byte variable
-  uint16_t dotlen;              // length of dot (msec)
-  uint16_t dashlen;             // length of dash (msec)
-  uint16_t plen;                // length of delay between dits/dahs
-  uint16_t clen;                // inter-character delay in addition to inter-element delay
-  uint16_t wlen;                // inter-word delay in addition to inter-character delay
-  uint16_t hang;                // PTT tail hang time
-  uint8_t  myspeed;             // effective speed (from host, from pot, or buffered)
-
-  static unsigned long straight_pressed;  // for timing straight key signals
-
-
-  //
-  // If a paddle or the straight key is hit:
-  // -abort sending buffered characters (and clear the buffer)
-  // -abort sending EEPROM messages
-  // -set "breakin" flag (for WK2 status message)
-  //
-  if ((eff_kdash || eff_kdot || straight) && (keyer_state >= SNDCHAR_PTT)) {
-    breakin=1;
-    clearbuf();
-    ReplayPointer=0;
-    keyer_state=CHECK;
-    wait=actual+10;      // will be re-computed soon
-  }
-
-  //
-  // HostMode speed overrides "local" speed
-  //
-  if (HostSpeed == 0) {
-    myspeed=Speed;
-  } else {
-    myspeed=HostSpeed;
-  }
-
-  static int old_myspeed=0;
+// This involves several divisions which are expensive on 8-bit CPUs, so
+// the result is cached and only re-computed if one of the settings it
+// depends on has changed. This is the case, e.g., once after switching
+// to a different settings profile, or when the speed changes.
+//
+//////////////////////////////////////////////////////////////////////////////
 
-  if (myspeed != old_myspeed) {
-    old_myspeed=myspeed;
-    SendControlChange(MY_MIDI_CHANNEL, MY_SPEED_CTL, myspeed);
-  }
+static uint16_t dotlen;                 // length of dot (msec)
+static uint16_t dashlen;                // length of dash (msec)
+static uint16_t plen;                   // length of delay between dits/dahs
+static uint16_t clen;                   // inter-character delay in addition to inter-element delay
+static uint16_t wlen;                   // inter-word delay in addition to inter-character delay
+static uint16_t hang;                   // PTT tail hang time
 
+void compute_timing(uint8_t myspeed) {
+  int i;
+  static uint8_t old_speed=0;
+  static uint8_t old_ratio, old_weight, old_comp, old_farns, old_ct, old_hang;
 
-  //
-  // If sending from the buffer, possibly use "buffered speed"
-  //
-  if (keyer_state >= SNDCHAR_PTT && BufSpeed != 0) myspeed=BufSpeed;
+  if (myspeed == old_speed && Ratio == old_ratio && Weight == old_weight &&
+      Compensation == old_comp && Farnsworth == old_farns &&
+      USE_CT == old_ct && HANGBITS == old_hang) return;
 
+  old_speed=myspeed;
+  old_ratio=Ratio;
+  old_weight=Weight;
+  old_comp=Compensation;
+  old_farns=Farnsworth;
+  old_ct=USE_CT;
+  old_hang=HANGBITS;
 
   //
   // Standard Morse code timing
@@ -1503,19 +3160,176 @@ void keyer_state_machine() {
     case 2: hang = 11*dotlen; break;     // word space + 4 dots
     case 3: hang = 15*dotlen; break;     // word space + 8 dots
   }
+}
+
+#ifdef BUFSTART
+//////////////////////////////////////////////////////////////////////////////
+//
+// Jitter buffer for text from the host.
+//
+// Some programs send text character by character, with delays in between.
+// If the keyer starts with the first character right away, it may run out
+// of characters in the middle of a word, producing irregular gaps. So once
+// the buffer has run empty, playback only re-starts when BUFSTART characters,
+// or a space (or a buffered command), are in the buffer, or when the first
+// one has been waiting for about one character time (10 dot lengths).
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#define BUFGATE_OPEN   0        // playback running
+#define BUFGATE_EMPTY  1        // buffer has run empty
+#define BUFGATE_WAIT   2        // characters arrived, waiting for more
+
+static uint8_t bufgate=BUFGATE_EMPTY;
+static tick_t bufarrival;               // time first character seen after running empty
+
+uint8_t buf_ready() {
+  uint8_t i,n,c;
+
+  if (bufgate == BUFGATE_OPEN) return 1;
+  if (bufgate == BUFGATE_EMPTY) {
+    bufgate=BUFGATE_WAIT;
+    bufarrival=actual;
+  }
+  n=bufcount();
+  if (n >= BUFSTART || REACHED(bufarrival + 10*dotlen)) {
+    bufgate=BUFGATE_OPEN;
+    return 1;
+  }
+  for (i=0; i<n; i++) {
+    c=character_buffer[(bufrx+i) & (BUFLEN-1)];
+    if (c != 0 && c <= 32) {           // NULs are place-holders
+      bufgate=BUFGATE_OPEN;
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
+///////////////////////////////////////
+//
+// Keep track of how late the keyer state machine
+// noticed that "wait" has been reached.
+//
+// All element, gap and character boundaries are computed
+// from the previous deadline ("wait"), not from the time
+// the deadline has been noticed ("actual"), so a late
+// loop() shortens the next interval but does not make the
+// character longer.
+// This catch-up is limited: if the deadline has been missed
+// by more than half a dot length (a long stall of loop() or the
+// keyer interrupt), the next element would be cut to less than
+// half a dot, and after longer stalls the following elements
+// would be sent back to back, or not at all (key-down and key-up
+// in the same pass). In this case, timing is re-started
+// from now, such that the stall lengthens the current element
+// instead of garbling the following ones.
+//
+///////////////////////////////////////
+
+void deadline_met() {
+  tick_t late=actual-wait;
+  if (late > late_max) late_max = late > 255 ? 255 : late;
+  if (late > dotlen/2) wait=actual;
+#ifdef AUDIOCLOCK
+  key_edge=wait;
+  key_edge_valid=1;
+#endif
+}
+
+///////////////////////////////////////
+//
+// This is the Keyer state machine
+//
+///////////////////////////////////////
+
+void keyer_state_machine() {
+  uint8_t byte;                 // general one-byte variable
+  uint8_t  myspeed;             // effective speed (from host, from pot, or buffered)
+
+#ifdef AUDIOCLOCK
+  key_edge_valid=0;             // only valid for the deadline met in this pass
+#endif
+
+  //
+  // If a paddle or the straight key is hit:
+  // -abort sending buffered characters (and clear the buffer)
+  // -abort sending EEPROM messages
+  // -set "breakin" flag (for WK2 status message)
+  //
+  // With BREAKIN_RESUME (and breakin_mode != 0), the buffer is kept
+  // but paused instead. A character not yet completely sent will
+  // be sent again, unless its place in the buffer may already have
+  // been re-used.
+  //
+  if ((eff_kdash || eff_kdot || straight) && (keyer_state >= SNDCHAR_PTT)) {
+    breakin=1;
+#ifdef BREAKIN_RESUME
+    if (breakin_mode != 0 && ReplayPointer == 0) {
+      if ((keyer_state != SNDCHAR_DELAY || sending != 1) &&
+          (uint8_t)(buftx - charstart) < BUFLEN-3) bufrx=charstart;
+      pausing=1;
+      breakin_paused=1;
+    } else
+#endif
+    clearbuf();
+    ReplayPointer=0;
+    keyer_state=CHECK;
+    wait=actual+10;      // will be re-computed soon
+    chain=0;
+  }
+
+  //
+  // HostMode speed overrides "local" speed
+  //
+  if (HostSpeed == 0) {
+    myspeed=Speed;
+  } else {
+    myspeed=HostSpeed;
+  }
+
+  static int old_myspeed=0;
+
+  if (myspeed != old_myspeed) {
+    old_myspeed=myspeed;
+    post_event(EV_SPEED, myspeed);
+  }
+
+
+  //
+  // If sending from the buffer, possibly use "buffered speed"
+  //
+  if (keyer_state >= SNDCHAR_PTT && BufSpeed != 0) myspeed=BufSpeed;
+
+  compute_timing(myspeed);
+
+#ifdef SERIAL_ISR
+  //
+  // CLEAR command seen by the serial interrupt
+  //
+  if (clear_request) {
+    clear_request=0;
+    bufrx=buftx;
+    pausing=0;
+    BufSpeed=0;
+  }
+#endif
+
+  tick_t start;                  // start of a character sent from buffer or EEPROM
 
   switch (keyer_state) {
     case CHECK:
       // reset number of elements sent
       num_elements=0;
       // wait = time when PTT is switched off
-      if (actual >= wait) ptt_off();
-      if (collpos > 0 && actual > last + 2 * dotlen) {
+      if (REACHED(wait)) ptt_off();
+      if (collpos > 0 && PASSED(last + 2 * dotlen)) {
         // a morse code pattern has been entered and the character is complete
         // echo it in ASCII on the display and on the serial line
         collecting |= 1 << collpos;
         if (PADDLE_ECHO && hostmode) {
-          ToHost(Morse_to_ASCII(collecting));
+          post_event(EV_TOHOST, Morse_to_ASCII(collecting));
         }
         collecting=0;
         collpos=0;
@@ -1524,8 +3338,8 @@ void keyer_state_machine() {
       // anything between one inter-word pause and "infinity pause" produces exactly one space
       // in the serial echo
       //
-      if (collpos == 0 && sentspace == 0 && actual > last + 6*dotlen) {
-         if (PADDLE_ECHO && hostmode) ToHost(32);
+      if (collpos == 0 && sentspace == 0 && PASSED(last + 6*dotlen)) {
+         if (PADDLE_ECHO && hostmode) post_event(EV_TOHOST, 32);
          sentspace=1;
       }
       //
@@ -1567,10 +3381,47 @@ void keyer_state_machine() {
         break;
       }
 
+#ifdef BREAKIN_RESUME
+      //
+      // Resume after a break-in when the paddle character is complete,
+      // and there was no keying for the time given by breakin_mode
+      //
+      if (breakin_paused && breakin_mode != 255 && collpos == 0 &&
+          PASSED(last + 100*breakin_mode)) {
+        breakin_paused=0;
+        pausing=0;
+      }
+#endif
+      //
+      // A character that has already been waiting when the previous
+      // one ended (see SNDCHAR_DELAY) starts at the end of the previous one,
+      // otherwise it starts now.
+      //
+      if (ReplayPointer == 0 && (bufcount() == 0 || pausing)) chain=0;
+      start = chain ? chain : actual;
+
       if (ReplayPointer !=0) {
         pausing=0;
         clearbuf();
+#ifdef BREAKIN_RESUME
+        charstart=bufrx;     // nothing to re-send from the buffer
+#endif
         sending = EEPROM.read(ReplayPointer++);
+        //
+        // Protocol extension: 0x00 <addr> continues the message at <addr>,
+        // so that messages can share a common tail (see tools/wkmsg).
+        // 0x00 is no valid pattern (there is no end-of-character bit).
+        // Only one jump per character, the target must be in the message
+        // area: anything else ends the message.
+        //
+        if (sending == 0x00) {
+          ReplayPointer = ReplayPointer ? EEPROM.read(ReplayPointer) : 0;
+          sending = (ReplayPointer >= 24) ? EEPROM.read(ReplayPointer++) : 0x00;
+          if (sending == 0x00) {
+            ReplayPointer=0;
+            break;
+          }
+        }
         if (sending & 0x80) {
           sending &= 0x7F;
           ReplayPointer=0;
@@ -1583,19 +3434,20 @@ void keyer_state_machine() {
         //
         if (sending == 0x1c) {
           sending=0x01;
-          wait=actual+wlen;
+          wait=start+wlen;
           if (!ptt_stat && PTT_ENABLED) {
             ptt_on();
           }
           keyer_state=SNDCHAR_DELAY;
         } else {
-          wait=actual;  // no lead-in wait by default
+          wait=start;  // no lead-in wait by default
           if (!ptt_stat && PTT_ENABLED) {
             ptt_on();
             wait=actual+LeadIn*10;
           }
           keyer_state=SNDCHAR_PTT;
         }
+        chain=0;
         break;
       }
 
@@ -1607,13 +3459,34 @@ void keyer_state_machine() {
       // character. This is important for programs that wait for the "serial echo" of any
       // character before sending the next one.
       //
-      if (bufcnt > 0 && !pausing) {
+#ifdef RTTY
+      if (rtty_on) {
+        if (bufcount() > 0 && !pausing) {
+          wait=actual;
+          if (!ptt_stat && PTT_ENABLED) {
+            ptt_on();
+            wait=actual+LeadIn*10;
+          }
+          keyer_state=SNDRTTY;
+        }
+        break;
+      }
+#endif
+#ifdef BUFSTART
+      if (bufcount() == 0) bufgate=BUFGATE_EMPTY;
+      if (bufcount() > 0 && !pausing && buf_ready()) {
+#else
+      if (bufcount() > 0 && !pausing) {
+#endif
         //
         // transfer next character to "sending"
         //
+#ifdef BREAKIN_RESUME
+        charstart=bufrx;
+#endif
         byte=FromBuffer();
         if (byte >=32 && byte <=127 && SERIAL_ECHO) {
-          ToHost(byte);
+          post_event(EV_TOHOST, byte);
           wait=actual+dotlen; // host may wait for the byte before sending the next one
         }
         switch (byte) {
@@ -1639,8 +3512,9 @@ void keyer_state_machine() {
             break;
           case 32:  // space
             sending=1;
-            wait=actual + wlen;
+            wait=start + wlen;
             keyer_state=SNDCHAR_DELAY;
+            chain=0;
             break;
           //
           // PROTOCOL EXTENSION: Special treatment of "[", "$", and "]"
@@ -1676,18 +3550,20 @@ void keyer_state_machine() {
           case '|':  // thin space (a fulldotlen)
             // Note that the K1EL chip does half a dotlen but this is rather small
             sending=1;
-            wait=actual + dotlen;
+            wait=start + dotlen;
             keyer_state=SNDCHAR_DELAY;
+            chain=0;
             break;
           default:
             sending=ASCII_to_Morse(byte);
             if (sending != 1) {
-              wait=actual;  // no lead-in wait by default
+              wait=start;  // no lead-in wait by default
               if (!ptt_stat && PTT_ENABLED) {
                 ptt_on();
                 wait=actual+LeadIn*10;
               }
               keyer_state=SNDCHAR_PTT;
+              chain=0;
             }
             break;
         }
@@ -1696,22 +3572,24 @@ void keyer_state_machine() {
       break;
     case STARTDOT:
       // wait = end of PTT lead-in time
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         keyer_state=SENDDOT;
         memdash=0;
         dash_held=eff_kdash;
-        wait=actual+dotlen;
+        wait=wait+dotlen;
         keydown();
         num_elements++;
       }
       break;
     case STARTDASH:
       // wait = end of PTT lead-in time
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         keyer_state=SENDDASH;
         memdot=0;
         dot_held=eff_kdot;
-        wait=actual+dashlen;
+        wait=wait+dashlen;
         keydown();
         num_elements++;
       }
@@ -1719,7 +3597,7 @@ void keyer_state_machine() {
     case STARTSTRAIGHT:
       // wait = end of PTT lead-in time
       memdot=memdash=dot_held=dash_held=0;
-      if (actual >= wait) {
+      if (REACHED(wait)) {
         if (straight) {
           keyer_state=SENDSTRAIGHT;
           keydown();
@@ -1734,7 +3612,8 @@ void keyer_state_machine() {
       }
     case SENDDOT:
       // wait = end of the dot
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         last=actual;
         keyup();
         wait=wait+plen;
@@ -1748,7 +3627,7 @@ void keyer_state_machine() {
         last=actual;
         keyup();
         // determine length of elements and treat it as a dash if long enough
-        if (actual  > straight_pressed + 2*plen) {
+        if (PASSED(straight_pressed + 2*plen)) {
           collecting |= (1 << collpos++);
         } else {
           collpos++;
@@ -1759,8 +3638,8 @@ void keyer_state_machine() {
       break;
     case DOTDELAY:
       // wait = end of the pause following a dot
-      if (actual >= wait) {
-        if (!eff_kdot && !eff_kdash && IAMBIC_A) dash_held=0;
+      if (REACHED(wait)) {
+        if (!eff_kdot && !eff_kdash && iambic_a) dash_held=0;
         if (memdash || eff_kdash || dash_held) {
           collecting |= (1 << collpos++);
           keyer_state=STARTDASH;
@@ -1769,13 +3648,14 @@ void keyer_state_machine() {
           keyer_state=STARTDOT;
         } else {
           keyer_state=CHECK;
-          wait=actual+hang-plen;
+          wait=wait+hang-plen;
         }
       }
       break;
     case SENDDASH:
       // wait = end of the dash
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         last=actual;
         keyup();
         wait=wait+plen;
@@ -1784,8 +3664,8 @@ void keyer_state_machine() {
       break;
     case DASHDELAY:
       // wait = end of the pause following the dash
-      if (actual > wait) {
-        if (!eff_kdot && !eff_kdash && IAMBIC_A) dot_held=0;
+      if (PASSED(wait)) {
+        if (!eff_kdot && !eff_kdash && iambic_a) dot_held=0;
         if (memdot || eff_kdot || dot_held) {
           collpos++;
           keyer_state=STARTDOT;
@@ -1794,24 +3674,26 @@ void keyer_state_machine() {
           keyer_state=STARTDASH;
         } else {
           keyer_state=CHECK;
-          wait=actual+hang-plen;
+          wait=wait+hang-plen;
         }
       }
       break;
     case SNDCHAR_PTT:
       // wait = end of PTT lead-in wait
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         keyer_state=SNDCHAR_ELE;
         keydown();
-        wait=actual + ((sending & 0x01) ? dashlen : dotlen);
+        wait=wait + ((sending & 0x01) ? dashlen : dotlen);
         sending = (sending >> 1) & 0x7F;
       }
       break;
     case SNDCHAR_ELE:
       // wait = end of the current element (dot or dash)
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         keyup();
-        wait=actual+plen;
+        wait=wait+plen;
         if (sending == 1) {
           if (!prosign) wait += clen;
           prosign=0;
@@ -1821,10 +3703,16 @@ void keyer_state_machine() {
       break;
     case SNDCHAR_DELAY:
       // wait = end  of pause (inter-element or inter-word)
-      if (actual >= wait) {
+      if (REACHED(wait)) {
+        deadline_met();
         if (sending == 1) {
           keyer_state=CHECK;
           //
+          // If the next character is already waiting, it will be
+          // chained to the end of this one.
+          //
+          chain = (ReplayPointer != 0 || (bufcount() > 0 && !pausing)) ? wait : 0;
+          //
           // This is the ONLY PLACE where the "PTT Tail" time applies.
           // Note that the PTT Tail time *adds* to the three-dots
           // inter-word spacing, so it is not used normally.
@@ -1848,11 +3736,45 @@ void keyer_state_machine() {
         } else {
           keydown();
           keyer_state=SNDCHAR_ELE;
-          wait=actual + ((sending & 0x01) ? dashlen : dotlen);
+          wait=wait + ((sending & 0x01) ? dashlen : dotlen);
           sending = (sending >> 1) & 0x7F;
         }
       }
       break;
+    case SNDRTTY:
+#ifdef RTTY
+      // wait = end of PTT lead-in time, then feed the FSK queue
+      if (!rtty_on) {
+        keyer_state=CHECK;
+        break;
+      }
+      if (!REACHED(wait)) break;
+      while (bufcount() > 0 && !pausing && rtty_room() >= 2) {
+        byte=FromBuffer();
+        switch (byte) {
+          case KEYBUF:        // ignored
+          case WAIT:          // ignored
+          case SETPTT:        // ignored
+          case HSCWSPD:       // ignored
+          case BUFSPD:        // ignored
+            FromBuffer();
+            break;
+          default:
+            if (rtty_put(byte) && byte >=32 && byte <=127 && SERIAL_ECHO) {
+              post_event(EV_TOHOST, byte);
+            }
+            break;
+        }
+      }
+      if ((bufcount() == 0 || pausing) && rtty_idle()) {
+        // last stop bit is out: PTT tail, then back to CHECK
+        keyer_state=CHECK;
+        wait=actual + ((Tail > 0) ? 10*Tail : 10);
+      }
+#else
+      keyer_state=CHECK;
+#endif
+      break;
   }
 }
 
@@ -1981,14 +3903,14 @@ void WinKey_state_machine() {
         break;
       case SWALLOW:
         // "swallow" a number of bytes given in "inum"
-        if (inum-- == 0) winkey_state=FREE;
+        if (--inum == 0) winkey_state=FREE;
         break;
       case XECHO:
         ToHost(byte);
         winkey_state=FREE;
         break;
       case MESSAGE:
-        if (byte >= 1 && byte <= 6) ReplayPointer=EEPROM.read(17+byte);
+        if (byte >= 1 && byte <= 6) post_input(IN_MESSAGE, EEPROM.read(17+byte));
         winkey_state=FREE;
         break;
       case ADMIN:
@@ -2025,6 +3947,7 @@ void WinKey_state_machine() {
             // Cannot reset baud rate, since some clients will
             // very quickly send "something" after the admin close
             //
+            hostmode=0;
             HostSpeed = 0;
             clearbuf();
             // restore "standalone" settings from EEPROM
@@ -2112,6 +4035,7 @@ void WinKey_state_machine() {
 #endif
               highbaud=0;
             }
+            winkey_state=FREE;
             break;
           case ADMIN_HIGHBAUD: // Admin Set High Baud
             if (!highbaud) {
@@ -2124,8 +4048,13 @@ void WinKey_state_machine() {
             winkey_state=FREE;
             break;
           case ADMIN_RTTY:  // expect 2 bytes with RTTY parameters, WK3 only.
+#ifdef RTTY
+            inum=0;
+            winkey_state=RTTYREG;
+#else
             inum=2;
             winkey_state=SWALLOW;
+#endif
             break;
           case ADMIN_SETWK3: // Set WK3 mode (WK3 only)
              winkey_state=FREE;
@@ -2146,9 +4075,92 @@ void WinKey_state_machine() {
              ToHost(0);  // Fake a DIP
              winkey_state=FREE;
              break;
-          case ADMIN_VOLUME: // Sidetone volume (WK3 only), ignored
-            inum=1;
-            winkey_state=SWALLOW;
+          case ADMIN_VOLUME: // Sidetone volume (WK3 only), 1=low ... 4=high
+            winkey_state=STVOLUME;
+            break;
+          case ADMIN_XVOLUME:    // PROTOCOL EXTENSION: expect side tone and RX volume, nothing returned
+            inum=0;
+            winkey_state=XVOLUME;
+            break;
+          case ADMIN_XPROFILE:   // PROTOCOL EXTENSION: expect profile number, nothing returned
+            winkey_state=LDPROFILE;
+            break;
+          case ADMIN_XSVPROFILE: // PROTOCOL EXTENSION: expect profile number, nothing returned
+            winkey_state=SVPROFILE;
+            break;
+          case ADMIN_XHWPROFILE: // PROTOCOL EXTENSION: expect preset number, nothing returned
+            winkey_state=HWPROFSEL;
+            break;
+          case ADMIN_XMIDIPAD:   // PROTOCOL EXTENSION: expect 0/1, nothing returned
+            winkey_state=MIDIPAD;
+            break;
+          case ADMIN_XBREAKIN:   // PROTOCOL EXTENSION: expect break-in mode, nothing returned
+            winkey_state=BRKMODE;
+            break;
+          case ADMIN_XREMAINDER: // PROTOCOL EXTENSION: return number of unsent bytes, then the bytes
+            {
+              uint8_t rx=bufrx;
+              uint8_t n=buftx-rx;
+              ToHost(n);
+              while (n--) {
+                ToHost(character_buffer[rx++ & (BUFLEN-1)]);
+              }
+            }
+            winkey_state=FREE;
+            break;
+          case ADMIN_XLATENESS:  // PROTOCOL EXTENSION: return max. lateness (msec) and reset it
+            ToHost(late_max);
+            late_max=0;
+            winkey_state=FREE;
+            break;
+          case ADMIN_XINLATENCY: // PROTOCOL EXTENSION: return max. input latency (msec) and reset it
+            ToHost(in_lat_max);
+            in_lat_max=0;
+            winkey_state=FREE;
+            break;
+          case ADMIN_XZEROBEAT:  // PROTOCOL EXTENSION: expect mode, nothing returned
+            winkey_state=ZBMODE;
+            break;
+          case ADMIN_XZBOFFSET:  // PROTOCOL EXTENSION: return offset (Hz), high byte first
+            {
+              uint16_t offset=0x8000;   // no CW tone found
+#ifdef ZEROBEAT
+              if (zb_freq > 0) offset=(int16_t) zb_freq - (int16_t) myfreq;
+#endif
+              ToHost(offset >> 8);
+              ToHost(offset & 0xFF);
+            }
+            winkey_state=FREE;
+            break;
+          case ADMIN_XBOOTTIME:  // PROTOCOL EXTENSION: return msec until keyer live, audio ready, first key-down
+            //
+            // 16 bits each, saturated at 0xFFFF; 0 for "no key-down yet"
+            //
+            {
+              uint16_t t[3];
+              t[0]=boot_keyer    > 0xFFFF ? 0xFFFF : boot_keyer;
+              t[1]=boot_audio    > 0xFFFF ? 0xFFFF : boot_audio;
+              t[2]=boot_firstkey > 0xFFFF ? 0xFFFF : boot_firstkey;
+              if (!boot_keyed) t[2]=0;
+              for (int i=0; i<3; i++) {
+                ToHost(t[i] >> 8);
+                ToHost(t[i] & 0xFF);
+              }
+            }
+            winkey_state=FREE;
+            break;
+          case ADMIN_XCYCLES:    // PROTOCOL EXTENSION: return max. cycles per audio block and keyer interrupt
+            {
+              uint32_t audio=0, keyer=0;
+#ifdef ISR_CYCLES
+              audio=cycles_audio;
+              keyer=cycles_keyer;
+              cycles_audio=cycles_keyer=0;
+#endif
+              for (int k=24; k >= 0; k -= 8) ToHost((audio >> k) & 0xFF);
+              for (int k=24; k >= 0; k -= 8) ToHost((keyer >> k) & 0xFF);
+            }
+            winkey_state=FREE;
             break;
           default: // Should not occur. Do not return anything.
              winkey_state=FREE;
@@ -2202,6 +4214,9 @@ void WinKey_state_machine() {
         break;
       case PAUSE:
         pausing=byte;
+#ifdef BREAKIN_RESUME
+        breakin_paused=0;    // host takes over
+#endif
         winkey_state=FREE;
         break;
       case PINCONFIG:
@@ -2210,21 +4225,29 @@ void WinKey_state_machine() {
         break;
       case TUNE:
         // use fixed lead-in/tail times with "busy waiting".
+        // The keyer interrupt may just be switching PTT or posting events,
+        // so key and PTT are only changed with the interrupt blocked.
         if (byte) {
           clearbuf();
+          LOCK_KEYER;
           tuning=1;
-          if (PTT_ENABLED) {
-            ptt_on();
-            delay(100);
-          }
+          if (PTT_ENABLED) ptt_on();
+          UNLOCK_KEYER;
+          if (PTT_ENABLED) delay(100);
+          LOCK_KEYER;
           keydown();
+          UNLOCK_KEYER;
         } else {
+          LOCK_KEYER;
           keyup();
+          UNLOCK_KEYER;
           if (PTT_ENABLED) {
             delay(100);
           }
+          LOCK_KEYER;
           ptt_off();
           tuning=0;
+          UNLOCK_KEYER;
         }
         winkey_state=FREE;
         break;
@@ -2314,14 +4337,21 @@ void WinKey_state_machine() {
         winkey_state=FREE;
         break;
       case SOFTPAD:
-        // software paddle ignored
+        // software paddle: 0 = open, 1 = dot, 2 = dash, 3 = both
+        // PROTOCOL EXTENSION: +4 = straight key closed
+        post_input(IN_SOFTPAD, byte & 7);
         winkey_state=FREE;
         break;
       case POINTER_1:
+         // set buffer position, overwrite mode
+         if (byte > 0) byte--;
+         setbufpos(byte, 1);
+         winkey_state=FREE;
+         break;
       case POINTER_2:
-         // set buffer position
+         // set buffer position, append mode
          if (byte > 0) byte--;
-         setbufpos(byte);
+         setbufpos(byte, 2);
          winkey_state=FREE;
          break;
       case POINTER_3:
@@ -2338,6 +4368,76 @@ void WinKey_state_machine() {
           default: winkey_state=FREE;      break;
         }
         break;
+      case LDPROFILE:
+#ifdef PROFILES
+        select_profile(byte);
+#endif
+        winkey_state=FREE;
+        break;
+      case SVPROFILE:
+#ifdef PROFILES
+        store_profile(byte);
+#endif
+        winkey_state=FREE;
+        break;
+      case HWPROFSEL:
+#ifdef HWPROFILE
+        hw_store(byte);
+#endif
+        winkey_state=FREE;
+        break;
+      case MIDIPAD:
+#ifdef MIDI_PADDLES
+        paddle_midi=(byte != 0);
+#endif
+        winkey_state=FREE;
+        break;
+      case STVOLUME:
+#ifdef TEENSY4AUDIO
+        sidetone.set_volume(byte >= 4 ? 255 : byte*64);
+#endif
+        winkey_state=FREE;
+        break;
+      case RTTYREG:
+#ifdef RTTY
+        if (inum++ == 0) {
+          rtty_reg1=byte;
+        } else {
+          rtty_reg2=byte;
+          LOCK_KEYER;
+          rtty_setup();
+          UNLOCK_KEYER;
+          winkey_state=FREE;
+        }
+#endif
+        break;
+      case XVOLUME:
+        switch (inum++) {
+          case 0:
+#ifdef TEENSY4AUDIO
+            sidetone.set_volume(byte);
+#endif
+            break;
+          case 1:
+#ifdef TEENSY4AUDIO
+            sidetone.set_rx_volume(byte);
+#endif
+            winkey_state=FREE;
+        }
+        break;
+      case BRKMODE:
+#ifdef BREAKIN_RESUME
+        breakin_mode=byte;
+#endif
+        winkey_state=FREE;
+        break;
+      case ZBMODE:
+#ifdef ZEROBEAT
+        if (byte <= 2) zb_mode=byte;
+        if (zb_mode == 0) zb_freq=0;
+#endif
+        winkey_state=FREE;
+        break;
       case RATIO:
         if (byte < 33) byte=33;
         if (byte > 66) byte=66;
@@ -2377,6 +4477,7 @@ void WinKey_state_machine() {
         break;
       case HSCWSPD:
         queue(2,HSCWSPD,byte,0);
+        winkey_state=FREE;
         break;
       default:
         winkey_state=FREE;
@@ -2387,6 +4488,11 @@ void WinKey_state_machine() {
   //
   // loop exit code: update WK status and send if changed
   //
+  if (bufcount() > BUFMARGIN) {
+    WKstatus |= 0x01;
+  } else {
+    WKstatus &= 0xFE;
+  }
   if (breakin) {
     WKstatus |= 0x02;
     breakin=0;
@@ -2478,62 +4584,126 @@ void goto_sleep() {
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// This is executed again and again at a high rate.
-// Most of the time, there will be nothing to do.
+// Input event bus
+//
+// All key sources (paddle contacts, straight key, SOFTPAD from the host,
+// messages started by a push-button or the host) do not write the keyer
+// variables themselves but post a time-stamped event with post_input().
+// The events are applied in time order by apply_inputs(), which is called
+// in the keyer context (at the end of sample_inputs), so there is one
+// single place where input can be recorded, replayed or injected.
+//
+// Events with the same time stamp are applied in the order of the source
+// numbers (enum INSRC), that is, the straight key first and messages last.
+// in_lat_max records the largest delay between posting and applying an
+// event (see ADMIN_XINLATENCY).
 //
 //////////////////////////////////////////////////////////////////////////////
 
-extern int usb_wait_rx_flag, usb_wait_tx_flag;
-
-void loop() {
-  int i;
-  static uint8_t LoopCounter=0;
-  static unsigned long DotDebounce=0;      // used for "debouncing" dot paddle contact
-  static unsigned long DashDebounce=0;     // used for "debouncing" dash paddle contact
-  static unsigned long StraightDebounce=0; // used for "debouncing" straight key contact
-  static uint8_t old_sidetone_enabled = 1;
-  static uint8_t old_sidetone = 1;
-
-  //////////////////////////////////////////////////////////////////////////////
-  //
-  //
-  // This sets the "now" time
-  //
-  //////////////////////////////////////////////////////////////////////////////
+void post_input(uint8_t src, uint8_t val) {
+  uint8_t pos, prev;
 
+  LOCK_KEYER;
+  pos=in_tx;
+  if ((uint8_t)(pos - in_rx) < INLEN) {
+    //
+    // Usually the new event goes to the end. Events from loop() may carry
+    // an earlier time stamp than those from the keyer interrupt, so move
+    // later (or same-time, lower-priority) events up by one slot.
+    //
+    while (pos != in_rx) {
+      prev=pos-1;
+      if (PASSED(in_time[prev & (INLEN-1)])) break;
+      if (in_time[prev & (INLEN-1)] == actual && in_src[prev & (INLEN-1)] <= src) break;
+      in_src [pos & (INLEN-1)]=in_src [prev & (INLEN-1)];
+      in_val [pos & (INLEN-1)]=in_val [prev & (INLEN-1)];
+      in_time[pos & (INLEN-1)]=in_time[prev & (INLEN-1)];
+      pos=prev;
+    }
+    in_src [pos & (INLEN-1)]=src;
+    in_val [pos & (INLEN-1)]=val;
+    in_time[pos & (INLEN-1)]=actual;
+    in_tx++;
+  }
+  UNLOCK_KEYER;
+}
 
-  actual=millis();
+void apply_inputs() {
+  uint8_t i, val;
+  tick_t late;
+
+  while (in_rx != in_tx) {
+    i=in_rx & (INLEN-1);
+    val=in_val[i];
+    late=actual-in_time[i];
+    if (late > in_lat_max) in_lat_max = late > 255 ? 255 : late;
+    switch (in_src[i]) {
+      case IN_STRAIGHT: kstraight=val;     break;
+      case IN_DOT:      pdot=val;          break;
+      case IN_DASH:     pdash=val;         break;
+      case IN_SOFTPAD:  softpad=val;       break;
+      case IN_MESSAGE:  ReplayPointer=val; break;
+    }
+    in_rx++;
+    //
+    // kdot/kdash: physical contact OR software paddle.
+    // If a contact closes, set dot/dash memory.
+    //
+    val=pdot | (softpad & 1);
+    if (val && !kdot) {
+      memdot=1;
+      lastpressed=0;
+    }
+    kdot=val;
+    val=pdash | ((softpad >> 1) & 1);
+    if (val && !kdash) {
+      memdash=1;
+      lastpressed=1;
+    }
+    kdash=val;
+  }
+}
 
-#ifdef POWERSAVE
+//////////////////////////////////////////////////////////////////////////////
+//
+// Sample the paddle and straight key contacts.
+// This is called from loop() or, with KEYER_ISR, from the keyer interrupt
+//
+// There is one version of this function for each paddle mode (bits 4-5 of
+// the ModeRegister, iambic-A and -B share one) and paddle swap setting
+// (bit 3), such that these need not be tested every time.
+// sample_inputs points to the version for the current ModeRegister, it is
+// changed by paddle_mode_select() when the ModeRegister has changed.
+// The only mode test left in the keyer state machine (IAMBIC_A) uses the
+// copy iambic_a instead.
+//
+// With MIDI_PADDLES, there is an additional version (PMODE_RAW) that sends
+// the debounced contacts as MIDI notes right away and hides them from the
+// keyer, for SDR programs that have their own keyer.
+//
+//////////////////////////////////////////////////////////////////////////////
 
-  //
-  // If we are in host mode, we are USB powered so no need to go to sleep
-  //
-  if (hostmode) watchdog=actual;
-  //
-  // look if more than 300 seconds passed since the last update of the watchdog
-  // timer and we are not in host mode. In this case, go to sleep. Take care of overflows.
-  //
+#define PMODE_IAMBIC    0x00
+#define PMODE_ULTIMATIC 0x20
+#define PMODE_BUG       0x30
+#define PMODE_RAW       0x40
 
-  unsigned long ul = watchdog + 300000UL;
+//
+// shared by all versions of sample_inputs
+//
+static tick_t DotDebounce=0;      // used for "debouncing" dot paddle contact
+static tick_t DashDebounce=0;     // used for "debouncing" dash paddle contact
+static tick_t StraightDebounce=0; // used for "debouncing" straight key contact
 
-  if (((ul > watchdog) && ((actual >= watchdog) && (actual <= ul))) ||
-      ((ul < watchdog) && ((actual >= watchdog) || (actual <= ul)))) {
-    // ul > watchdog  and actual between watchdog and ul: do not go to sleep (no-overflow case)
-    // ul < watchdog and actual has not yet reached the region between ul and watchdog:
-    // do not go to sleep (overflow case)
-    // host connection open: do not go to sleep.
-  } else {
-    goto_sleep();
-    actual=millis();
-    watchdog=actual;
-  }
+template <uint8_t PMODE, uint8_t SWAP> void sample_inputs_mode() {
+  int i;
+#if defined(PaddleRight) && defined(PaddleLeft)
+  uint8_t left, right;                     // paddle contacts (0 = closed)
 #endif
-  //
-  //
+
   //////////////////////////////////////////////////////////////////////////////
   //
-  // Read digital and analog input lines with debouncing.
+  // Read digital input lines with debouncing.
   //
   // For the left/right contacts assign them to dit/dah or dah/dit
   // depending on the ModeRegister. If state changes, set dot/dash memory.
@@ -2543,48 +4713,236 @@ void loop() {
   ///////////////////////////////////////////////////////////////////////////////
 
 #if defined(PaddleRight) && defined(PaddleLeft)
-  if (actual >= DotDebounce) {
-    i=!digitalRead(PADDLE_SWAP ? PaddleRight : PaddleLeft);
-    if (i != kdot) {
+#if defined(__AVR__) || defined(HWPROFILE)
+  if (fastpin_reg[FP_LEFT] == fastpin_reg[FP_RIGHT]) {
+    // both contacts on the same port: read it only once
+    i=*fastpin_reg[FP_LEFT];
+    left =(i & fastpin_mask[FP_LEFT])  ? HIGH : LOW;
+    right=(i & fastpin_mask[FP_RIGHT]) ? HIGH : LOW;
+  } else
+#endif
+  {
+    left =fastread(FP_LEFT,  PaddleLeft);
+    right=fastread(FP_RIGHT, PaddleRight);
+  }
+
+  if (REACHED(DotDebounce)) {
+    i=!(SWAP ? right : left);
+    if (i != pdot) {
 #ifdef POWERSAVE
-      watchdog=actual;
+      watchdog=millis();
 #endif
       DotDebounce=actual+10;
-      kdot=i;
-      if (kdot) {
-        memdot=1;
-        lastpressed=0;
-      }
+      post_input(IN_DOT, i);
+      if (PMODE == PMODE_RAW) post_event(EV_DOT, i);
     }
   }
 
-  if (actual >= DashDebounce) {
-    i=!digitalRead(PADDLE_SWAP ? PaddleLeft : PaddleRight);
-    if (i != kdash) {
+  if (REACHED(DashDebounce)) {
+    i=!(SWAP ? left : right);
+    if (i != pdash) {
 #ifdef POWERSAVE
-      watchdog=actual;
+      watchdog=millis();
 #endif
       DashDebounce=actual+10;
-      kdash=i;
-      if (kdash) {
-        memdash=1;
-        lastpressed=1;
-      }
+      post_input(IN_DASH, i);
+      if (PMODE == PMODE_RAW) post_event(EV_DASH, i);
     }
   }
 #endif
 
 #ifdef StraightKey
-  if (actual >= StraightDebounce) {
-    i=!digitalRead(StraightKey);
-    if (i != straight) {
+  if (REACHED(StraightDebounce)) {
+    i=!fastread(FP_STRAIGHT, StraightKey);
+    if (i != kstraight) {
 #ifdef POWERSAVE
-      watchdog=actual;
+      watchdog=millis();
 #endif
       StraightDebounce=actual+15;
-      straight=i;
+      post_input(IN_STRAIGHT, i);
+      if (PMODE == PMODE_RAW) post_event(EV_STRAIGHT, i);
+    }
+  }
+#endif
+
+  //
+  // Everything that came in since the last call (contacts from above,
+  // messages and SOFTPAD from loop()) is applied here, in order
+  //
+  apply_inputs();
+
+  /////////////////////////////////////////////////////////////////////////////////
+  //
+  // The bug and ultimatic modes are not implemented in the keyer.
+  // instead, we apply some logic to the "contact closures"
+  //
+  // So kdash and kdot reflect the state of the paddle contacts
+  // (physical or SOFTPAD) while eff_kdash and eff_kdot are the states as seen by
+  // the keyer.
+  //
+  // BUG MODE:
+  //     logical-OR the dash to the straight keyer contact,
+  //     and let the effective dash contact always "open"
+  //
+  // ULTIMATIC MODE:
+  //     never report "both contacts closed" to the keyer.
+  //     in this case, only the last-pressed contact wins.
+  //
+  /////////////////////////////////////////////////////////////////////////////////
+
+  eff_kdash=kdash;
+  eff_kdot=kdot;
+  straight=kstraight | (softpad >> 2);
+
+  if (PMODE == PMODE_RAW) {
+    memdot=memdash=0;
+    eff_kdot=eff_kdash=0;
+    straight=0;
+  }
+
+  if (PMODE == PMODE_BUG) {
+    straight |= kdash;
+    memdash=0;
+    eff_kdash=0;
+  }
+
+  if (PMODE == PMODE_ULTIMATIC && kdash && kdot) {
+    if (lastpressed) {
+      // last contact closed was dash, so do not report a closed dot contact upstream
+      eff_kdot=0;
+    } else {
+      // last contact closed was dot, so do not report a closed dash contact upstream
+      eff_kdash=0;
     }
   }
+}
+
+static void (*sample_inputs)() = sample_inputs_mode<PMODE_IAMBIC, 0>;
+static uint8_t paddle_mode=0x10;    // ModeRegister bits that select the version of sample_inputs
+
+void paddle_mode_select() {
+  void (*func)();
+  uint8_t mode=ModeRegister & 0x38;
+
+#ifdef MIDI_PADDLES
+  if (paddle_midi) mode=PMODE_RAW | (mode & 0x08);
+#endif
+  if (mode == paddle_mode) return;
+  switch (mode) {
+    case PMODE_ULTIMATIC:        func=sample_inputs_mode<PMODE_ULTIMATIC, 0>; break;
+    case PMODE_ULTIMATIC | 0x08: func=sample_inputs_mode<PMODE_ULTIMATIC, 1>; break;
+    case PMODE_BUG:              func=sample_inputs_mode<PMODE_BUG,       0>; break;
+    case PMODE_BUG | 0x08:       func=sample_inputs_mode<PMODE_BUG,       1>; break;
+    case 0x08: case 0x18:        func=sample_inputs_mode<PMODE_IAMBIC,    1>; break;
+#ifdef MIDI_PADDLES
+    case PMODE_RAW:              func=sample_inputs_mode<PMODE_RAW,       0>; break;
+    case PMODE_RAW | 0x08:       func=sample_inputs_mode<PMODE_RAW,       1>; break;
+#endif
+    default:                     func=sample_inputs_mode<PMODE_IAMBIC,    0>; break;
+  }
+  //
+  // The keyer interrupt posts raw-mode events itself, so the catch-up
+  // events and the switch are done with the interrupt blocked: no event
+  // is lost, and none comes from the old mode after the new one started.
+  //
+  LOCK_KEYER;
+#ifdef MIDI_PADDLES
+  if ((mode ^ paddle_mode) & PMODE_RAW) {
+    //
+    // switching to/from raw mode: tell the host the contacts
+    // that are closed now, or that they are no longer reported
+    //
+    if (pdot)      post_event(EV_DOT,      paddle_midi);
+    if (pdash)     post_event(EV_DASH,     paddle_midi);
+    if (kstraight) post_event(EV_STRAIGHT, paddle_midi);
+  }
+#endif
+  sample_inputs=func;
+  iambic_a=IAMBIC_A;
+  paddle_mode=mode;
+  UNLOCK_KEYER;
+}
+
+#ifdef KEYER_ISR
+//////////////////////////////////////////////////////////////////////////////
+//
+// Keyer interrupt: sample the keys and run the keyer state machine
+//
+//////////////////////////////////////////////////////////////////////////////
+
+void keyer_tick() {
+  CYCLES_START;
+  actual=KEYER_CLOCK();
+  sample_inputs();
+  if (!tuning) keyer_state_machine();
+  CYCLES_STOP(cycles_keyer);
+}
+#endif
+
+#ifdef TICK16
+//////////////////////////////////////////////////////////////////////////////
+//
+// Pull a 16-bit time-stamp along if it is more than TICK_STALE msec in the
+// past, before the difference to "actual" becomes ambiguous (32.7 sec).
+// Deadlines that have been reached stay reached, and start times stay older
+// than any interval measured from them. Called from loop() every 256 msec.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+void tick_age(uint16_t *t) {
+  uint16_t age=actual-*t;
+  if (age >= TICK_STALE && age < 0x8000) *t=actual-TICK_STALE;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// This is executed again and again at a high rate.
+// Most of the time, there will be nothing to do.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+extern int usb_wait_rx_flag, usb_wait_tx_flag;
+
+void loop() {
+  int i;
+  static uint8_t LoopCounter=0;
+  static uint8_t old_sidetone_enabled = 1;
+  static uint8_t old_sidetone = 1;
+
+  //////////////////////////////////////////////////////////////////////////////
+  //
+  //
+  // This sets the "now" time
+  //
+  //////////////////////////////////////////////////////////////////////////////
+
+
+  deferred_init();
+  actual=KEYER_CLOCK();
+
+#ifdef POWERSAVE
+
+  //
+  // If we are in host mode, we are USB powered so no need to go to sleep.
+  // The watchdog is a full 32-bit millis() time, 300 seconds do not fit into
+  // a 16-bit tick_t.
+  //
+  unsigned long now=millis();
+  if (hostmode) watchdog=now;
+  //
+  // look if more than 300 seconds passed since the last update of the watchdog
+  // timer and we are not in host mode. In this case, go to sleep. The unsigned
+  // difference takes care of overflows.
+  //
+  if (now - watchdog > 300000UL) {
+    goto_sleep();
+    actual=KEYER_CLOCK();
+    watchdog=millis();
+  }
+#endif
+#ifndef KEYER_ISR
+  sample_inputs();
 #endif
 
 #ifdef BUTTONPIN
@@ -2631,15 +4989,25 @@ void loop() {
 //
 // Since analog reads are expensive, we read every 10 msec if we are in pre  or post state, every 5 msec
 // in the wait state
+//
+// If settings profiles are used, the action is deferred until the button
+// is released: a short press plays the message, while holding the button
+// for more than BUTTON_LONGPRESS msec switches to the settings profile
+// with the same number.
 
 #define BUTTON_PRE_STATE 255
 #define BUTTON_WAIT_STATE 12
 #define BUTTON_POST_STATE 0
 static uint8_t button_state=BUTTON_PRE_STATE;
-static uint32_t    button_debounce=0;
+static tick_t      button_debounce=0;
 static uint16_t    button_val=4092;
+#ifdef PROFILES
+#define BUTTON_LONGPRESS 1000
+static uint8_t     button_pressed=0;     // number of button pressed, action pending
+static tick_t      button_time;          // time when button press was recognized
+#endif
 
-if (actual >= button_debounce) {
+if (HWPIN(BUTTONPIN) && REACHED(button_debounce)) {
   i=analogRead(BUTTONPIN);
   // exponential averaging.
   // button_val is between zero and 4*1023
@@ -2654,15 +5022,27 @@ if (actual >= button_debounce) {
         button_state=BUTTON_WAIT_STATE;
 #ifdef POWERSAVE
       // pressing a  button resets the "deep sleep" timer
-      watchdog=actual;
+      watchdog=millis();
 #endif
       }
       break;
     case BUTTON_POST_STATE:
       // remain in "post" state until the readout is above BUTTON_HIGH
       button_debounce=actual+10;
+#ifdef PROFILES
+      if (button_pressed && button_pressed <= PROFILES && REACHED(button_time + BUTTON_LONGPRESS)) {
+        // long press: switch settings profile
+        select_profile(button_pressed);
+        button_pressed=0;
+      }
+#endif
       if (button_val > BUTTON_HIGH) {
         button_state=BUTTON_PRE_STATE;
+#ifdef PROFILES
+        // short press: play message
+        if (button_pressed) post_input(IN_MESSAGE, EEPROM.read(17+button_pressed));
+        button_pressed=0;
+#endif
       }
       break;
     default:
@@ -2673,20 +5053,26 @@ if (actual >= button_debounce) {
         // a button while sending a message aborts that message and starts
         // the new one.
         if (button_val < BUTTON_BORDER_1) {
-            ReplayPointer = EEPROM.read(18);
+            i=1;
         } else if (button_val < BUTTON_BORDER_2) {
-            ReplayPointer = EEPROM.read(19);
+            i=2;
         } else if (button_val < BUTTON_BORDER_3) {
-            ReplayPointer = EEPROM.read(20);
+            i=3;
         } else if (button_val < BUTTON_BORDER_4) {
-            ReplayPointer= EEPROM.read(21);
+            i=4;
         } else if (button_val < BUTTON_BORDER_5) {
-            ReplayPointer= EEPROM.read(22);
+            i=5;
         } else if (button_val < BUTTON_BORDER_6) {
-            ReplayPointer= EEPROM.read(23);
+            i=6;
         }  else {
-            // Hardware spike, do nothing
+            i=0;  // Hardware spike, do nothing
         }
+#ifdef PROFILES
+        button_pressed=i;
+        button_time=actual;
+#else
+        if (i) post_input(IN_MESSAGE, EEPROM.read(17+i));
+#endif
       }
       break;
   }
@@ -2705,61 +5091,55 @@ if (actual >= button_debounce) {
   // The speed pot is debounced with a relatively long time constant
   //
   static int SpeedPinValue=2000;           // default value: mid position
-  static unsigned long SpeedDebounce=0;    // used for "debouncing" speed pot
+  static tick_t SpeedDebounce=0;           // used for "debouncing" speed pot
 
-  if ((keyer_state == CHECK || num_elements > 5) && (actual >= SpeedDebounce)) {
+  if (HWPIN(POTPIN) && (keyer_state == CHECK || num_elements > 5) && REACHED(SpeedDebounce)) {
     SpeedDebounce=actual + 20;
     i = analogRead(POTPIN);
     SpeedPinValue += (i - SpeedPinValue/4);  // Range 0 ... 4092
   }
 #endif
 
-  /////////////////////////////////////////////////////////////////////////////////
-  //
-  // The bug and ultimatic modes are not implemented in the keyer.
-  // instead, we apply some logic to the "contact closures"
-  //
-  // So kdash and kdot reflect the "physical" state of the paddle
-  // contacts while eff_kdash and eff_kdot are the states as seen by
-  // the keyer.
-  //
-  // BUG MODE:
-  //     logical-OR the dash to the straight keyer contact,
-  //     and let the effective dash contact always "open"
+#ifdef TICK16
   //
-  // ULTIMATIC MODE:
-  //     never report "both contacts closed" to the keyer.
-  //     in this case, only the last-pressed contact wins.
+  // keep the 16-bit time-stamps unambiguous, see tick_age()
   //
-  /////////////////////////////////////////////////////////////////////////////////
-
-  eff_kdash=kdash;
-  eff_kdot=kdot;
-
-  if (BUGMODE) {
-    straight |= kdash;
-    memdash=0;
-    eff_kdash=0;
-  }
-
-  if (ULTIMATIC && kdash && kdot) {
-    if (lastpressed) {
-      // last contact closed was dash, so do not report a closed dot contact upstream
-      eff_kdot=0;
-    } else {
-      // last contact closed was dot, so do not report a closed dash contact upstream
-      eff_kdash=0;
-    }
+  static uint8_t tick_page=0;
+  if ((uint8_t) (actual >> 8) != tick_page) {
+    tick_page=actual >> 8;
+    tick_age(&wait);
+    tick_age(&last);
+    tick_age(&straight_pressed);
+    tick_age(&DotDebounce);
+    tick_age(&DashDebounce);
+    tick_age(&StraightDebounce);
+#ifdef BUFSTART
+    tick_age(&bufarrival);
+#endif
+#ifdef BUTTONPIN
+    tick_age(&button_debounce);
+#ifdef PROFILES
+    tick_age(&button_time);
+#endif
+#endif
+#ifdef POTPIN
+    tick_age(&SpeedDebounce);
+#endif
   }
+#endif
 
   // WK2.3 change: end "TUNE" mode if a paddle is pressed
   if (tuning && (kdot || kdash)) {
+      LOCK_KEYER;
       keyup();
+      UNLOCK_KEYER;
       if (PTT_ENABLED) {
         delay(50);
       }
+      LOCK_KEYER;
       ptt_off();
       tuning=0;
+      UNLOCK_KEYER;
   }
   /////////////////////////////////////////////////////////////////////////////////
   //
@@ -2783,12 +5163,15 @@ if (actual >= button_debounce) {
       //
       // Do not change Speed if the SpeedPinValue changes slightly
       //
-      if (SpeedPinValue > OldSpeedPinValue + 100 || SpeedPinValue < OldSpeedPinValue - 100) {
-        OldSpeedPinValue = SpeedPinValue;
-        SpeedPot=((SpeedPinValue >> 6)*WPMrange+32) >> 6;
-        Speed=MinWPM+SpeedPot;
+      if (HWPIN(POTPIN)) {
+        if (SpeedPinValue > OldSpeedPinValue + 100 || SpeedPinValue < OldSpeedPinValue - 100) {
+          OldSpeedPinValue = SpeedPinValue;
+          SpeedPot=((SpeedPinValue >> 6)*WPMrange+32) >> 6;
+          Speed=MinWPM+SpeedPot;
+        }
+        break;
       }
-#else
+#endif
        //
        // If there is no speed pot, or speed pot is handled externally,
        // compute a "virtual" SpeedPot value since reporting this back
@@ -2797,12 +5180,12 @@ if (actual >= button_debounce) {
        SpeedPot = Speed - MinWPM; // maintain "virtual" value of speed pot
        if (Speed < MinWPM)  SpeedPot=0;
        if (SpeedPot > WPMrange) SpeedPot=WPMrange;
-#endif
        break;
     case 2:
        //
        // Check if Side tone settings changed
        //
+       paddle_mode_select();
        if (Sidetone != old_sidetone) {
          myfreq=4000/(Sidetone & 0x0F);
          old_sidetone = Sidetone;
@@ -2823,6 +5206,9 @@ if (actual >= button_debounce) {
           cwshield.sidetoneenable(old_sidetone_enabled);
 #endif
        }
+#ifdef ZEROBEAT
+       zerobeat_poll();
+#endif
       break;
     case 4:
       //
@@ -2843,8 +5229,13 @@ if (actual >= button_debounce) {
     case 7:
       //
       // execute the keyer state machine every second loop
+      // (if it runs in an interrupt, drain its events instead)
       //
+#ifdef KEYER_ISR
+      drain_events();
+#else
       if (!tuning) keyer_state_machine();
+#endif
       break;
     default:
       //
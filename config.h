@@ -16,3 +16,4 @@
 //#include "config.teensy.h"
 //#include "config.teensy4_bare.h"
 //#include "config.teensy4_sgtl5000.h"
+//#include "config.teensy4_universal.h"
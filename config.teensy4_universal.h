@@ -0,0 +1,20 @@
+////////////////////////////////////////////////////////////////////////////
+//
+// config.h file for a "universal" Teensy4 firmware image.
+//
+// The digital and analog lines, and whether MIDI and the AudioShield
+// (SGTL5000) are used, are not defined here but taken from a hardware
+// profile stored in the EEPROM (see HWPROFILE in config.list).
+// Compile with USB type "Serial + MIDI + Audio".
+//
+////////////////////////////////////////////////////////////////////////////
+
+#define HWPROFILE                   // lines and outputs from EEPROM
+#define MYSERIAL Serial             // use Serial-over-USB for Winkey protocol
+#define USBMIDI                     // MIDI messages (if enabled in the hardware profile)
+#define TEENSY4AUDIO                // I2S audio (if enabled in the hardware profile)
+
+#define MY_MIDI_CHANNEL               5   // default MIDI channel to use
+#define MY_KEYDOWN_NOTE               1   // default MIDI key-down note
+#define MY_PTT_NOTE                   2   // default MIDI ptt note
+#define MY_SPEED_CTL                  3   // default MIDI controller for reporting speed
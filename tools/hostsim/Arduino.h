@@ -0,0 +1,106 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Minimal Arduino API for running the sketch on a PC (hostsim)
+//
+// Time does not run by itself: millis() and micros() return the simulated
+// time hostsim_us which is advanced by the driver (and by delay()).
+// Digital pins are an array, writes to output pins are reported to the
+// driver through hostsim_pin_changed(). The serial port is a pair of
+// byte queues.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+
+#define FASTRUN
+#define FLASHMEM
+#define DMAMEM
+#define PROGMEM
+
+#define HOSTSIM_NPINS 64
+
+extern uint64_t hostsim_us;                 // simulated time in micro-seconds
+extern uint8_t  hostsim_pin[HOSTSIM_NPINS];
+void hostsim_pin_changed(int pin, int val);   // provided by the driver
+void hostsim_to_host(uint8_t c);              // provided by the driver
+
+inline unsigned long millis() { return (unsigned long) (hostsim_us / 1000); }
+inline unsigned long micros() { return (unsigned long) hostsim_us; }
+inline void delay(unsigned long ms) { hostsim_us += 1000ULL*ms; }
+inline void delayMicroseconds(unsigned int us) { hostsim_us += us; }
+
+inline void pinMode(int pin, int mode) { if (mode == INPUT_PULLUP) hostsim_pin[pin]=HIGH; }
+inline int  digitalRead(int pin) { return hostsim_pin[pin]; }
+inline void digitalWrite(int pin, int val) {
+  if (hostsim_pin[pin] != val) {
+    hostsim_pin[pin]=val;
+    hostsim_pin_changed(pin, val);
+  }
+}
+inline int  digitalReadFast(int pin) { return digitalRead(pin); }
+inline void digitalWriteFast(int pin, int val) { digitalWrite(pin, val); }
+inline int  analogRead(int) { return 1023; }
+inline void tone(int, unsigned int) {}
+inline void noTone(int) {}
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+inline void yield() {}
+
+#define HOSTSIM_SERLEN 4096
+
+class HostSerial {
+  public:
+    uint8_t  rxbuf[HOSTSIM_SERLEN];
+    unsigned rxhead=0, rxtail=0;
+
+    void begin(long) {}
+    void end() {}
+    void flush() {}
+    int available() { return (rxhead - rxtail) % HOSTSIM_SERLEN; }
+    int read() {
+      if (rxhead == rxtail) return -1;
+      int c=rxbuf[rxtail];
+      rxtail=(rxtail+1) % HOSTSIM_SERLEN;
+      return c;
+    }
+    size_t write(uint8_t c) { hostsim_to_host(c); return 1; }
+    //
+    // driver side: byte from the host
+    //
+    void put(uint8_t c) {
+      rxbuf[rxhead]=c;
+      rxhead=(rxhead+1) % HOSTSIM_SERLEN;
+    }
+    operator bool() { return true; }
+};
+
+extern HostSerial Serial;
+
+//
+// Timer interrupts do not exist here: the driver calls the
+// registered function itself.
+//
+class IntervalTimer {
+  public:
+    void (*func)()=0;
+    unsigned long period=0;
+    template<typename T> bool begin(void (*f)(), T p) { func=f; period=p; return true; }
+    void end() { func=0; }
+    void priority(uint8_t) {}
+};
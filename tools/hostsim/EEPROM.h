@@ -0,0 +1,24 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// EEPROM for hostsim: 1080 bytes (as on a Teensy 4) in RAM, starting
+// out in the "erased" state.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#define E2END 1079
+
+class HostEEPROM {
+  public:
+    uint8_t mem[E2END+1];
+    HostEEPROM() { memset(mem, 0xFF, sizeof(mem)); }
+    uint8_t read(int addr) { return mem[addr]; }
+    void write(int addr, uint8_t val) { mem[addr]=val; }
+    void update(int addr, uint8_t val) { mem[addr]=val; }
+    int length() { return E2END+1; }
+};
+
+extern HostEEPROM EEPROM;
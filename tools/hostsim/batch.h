@@ -0,0 +1,265 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Batch simulator: many independent paddle keyers, stepped in lock-step
+//
+// This is for statistical studies, e.g. how debouncing and the iambic mode
+// affect what comes out for thousands of (synthetic) operators.
+//
+// All state is kept in "struct of arrays" form, one array element ("lane")
+// per keyer. keyer_step() does one milli-second for all lanes, with the
+// same transitions as sample_inputs() and the paddle part of
+// keyer_state_machine() in the sketch (states CHECK ... DASHDELAY).
+// It is written without branches so the compiler can vectorize the loop
+// (with -O3, g++ 12 then does 4 lanes with SSE2 and 8 lanes with AVX2).
+// Not covered: straight key, BUG mode, PTT, and sending from the buffer.
+//
+// The synthetic operators (op_step) press random paddle combinations
+// for random times, and the contacts bounce for a while after each change.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_T0 1000             // time (msec) at which all lanes start
+
+//
+// keyer states, same numerical values as in the sketch
+//
+#define B_CHECK      0
+#define B_SENDDOT    1
+#define B_SENDDASH   2
+#define B_DOTDELAY   3
+#define B_DASHDELAY  4
+#define B_STARTDOT   5
+#define B_STARTDASH  6
+
+struct Batch {
+  int n;                          // number of lanes
+  //
+  // parameters, fixed for a run
+  //
+  uint32_t *dotlen, *dashlen, *plen, *hang;
+  uint32_t *iambic_a, *ultimatic;
+  uint32_t *debounce;             // debounce time (msec), 10 in the sketch
+  //
+  // inputs: raw paddle contacts (1 = closed)
+  //
+  uint32_t *rawdot, *rawdash;
+  //
+  // keyer state
+  //
+  uint32_t *state, *wait, *key;
+  uint32_t *kdot, *kdash, *dotdeb, *dashdeb;
+  uint32_t *memdot, *memdash, *dot_held, *dash_held, *lastpressed;
+  //
+  // results
+  //
+  uint32_t *ndot, *ndash, *hash;
+  //
+  // synthetic operators
+  //
+  uint32_t *rng, *op_pattern, *op_left, *op_bounce, *op_bouncelen, *op_unit;
+};
+
+static uint32_t *batch_array(int n) {
+  return (uint32_t *) calloc(n, sizeof(uint32_t));
+}
+
+static void batch_init(Batch *b, int n) {
+  b->n=n;
+  uint32_t **arrays[]={
+    &b->dotlen, &b->dashlen, &b->plen, &b->hang, &b->iambic_a, &b->ultimatic, &b->debounce,
+    &b->rawdot, &b->rawdash,
+    &b->state, &b->wait, &b->key, &b->kdot, &b->kdash, &b->dotdeb, &b->dashdeb,
+    &b->memdot, &b->memdash, &b->dot_held, &b->dash_held, &b->lastpressed,
+    &b->ndot, &b->ndash, &b->hash,
+    &b->rng, &b->op_pattern, &b->op_left, &b->op_bounce, &b->op_bouncelen, &b->op_unit
+  };
+  for (unsigned i=0; i < sizeof(arrays)/sizeof(arrays[0]); i++) {
+    *arrays[i]=batch_array(n);
+  }
+  for (int i=0; i<n; i++) {
+    b->debounce[i]=10;
+    b->op_left[i]=1;
+  }
+}
+
+//
+// Hash of the key-down/up time line. The scalar check uses the same function.
+//
+static inline uint32_t batch_hash(uint32_t h, uint32_t t, uint32_t key) {
+  return h*31 + 2*(t - BATCH_T0) + key;
+}
+
+//
+// One msec for all synthetic operators: produces rawdot[] and rawdash[]
+//
+static void op_step(Batch *b, int first, int last) {
+  for (int i=first; i<last; i++) {
+    uint32_t r=b->rng[i];
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    b->rng[i]=r;
+    if (--b->op_left[i] == 0) {
+      //
+      // new pattern (none, dot, dash, both), held for 1-4 "units" +/- 25%
+      //
+      b->op_pattern[i]=r & 3;
+      b->op_left[i]=(((r >> 2) & 3) + 1) * b->op_unit[i] * (75 + (r >> 4) % 51) / 100 + 1;
+      b->op_bounce[i]=b->op_bouncelen[i];
+    }
+    if (b->op_bounce[i] > 0) {
+      b->op_bounce[i]--;
+      b->rawdot[i] =(r >> 24) & 1;
+      b->rawdash[i]=(r >> 25) & 1;
+    } else {
+      b->rawdot[i] = b->op_pattern[i]       & 1;
+      b->rawdash[i]=(b->op_pattern[i] >> 1) & 1;
+    }
+  }
+}
+
+//
+// One msec (time t) for all keyers
+//
+static void keyer_step(Batch *b, uint32_t t) {
+  const uint32_t *dotlen=b->dotlen;
+  const uint32_t *dashlen=b->dashlen;
+  const uint32_t *plen=b->plen;
+  const uint32_t *hang=b->hang;
+  const uint32_t *iambic_a=b->iambic_a;
+  const uint32_t *ultimatic=b->ultimatic;
+  const uint32_t *debounce=b->debounce;
+  const uint32_t *rawdot=b->rawdot;
+  const uint32_t *rawdash=b->rawdash;
+  uint32_t *state=b->state;
+  uint32_t *wait=b->wait;
+  uint32_t *key=b->key;
+  uint32_t *kdot=b->kdot;
+  uint32_t *kdash=b->kdash;
+  uint32_t *dotdeb=b->dotdeb;
+  uint32_t *dashdeb=b->dashdeb;
+  uint32_t *memdot=b->memdot;
+  uint32_t *memdash=b->memdash;
+  uint32_t *dot_held=b->dot_held;
+  uint32_t *dash_held=b->dash_held;
+  uint32_t *lastpressed=b->lastpressed;
+  uint32_t *ndot=b->ndot;
+  uint32_t *ndash=b->ndash;
+  uint32_t *hash=b->hash;
+  const int n=b->n;
+  //
+  // The arrays never overlap, and the lanes are independent. Telling
+  // the compiler so is necessary for vectorization.
+  //
+#pragma GCC ivdep
+  for (int i=0; i<n; i++) {
+    //
+    // load everything first: conditional loads would prevent vectorization
+    //
+    uint32_t rd=rawdot[i], rs=rawdash[i];
+    uint32_t kd=kdot[i], ks=kdash[i];
+    uint32_t md=memdot[i], ms=memdash[i], lp=lastpressed[i];
+    uint32_t dd=dotdeb[i], sd=dashdeb[i], deb=debounce[i];
+    uint32_t dl=dotlen[i], sl=dashlen[i], pl=plen[i], hg=hang[i], ia=iambic_a[i];
+    uint32_t h=hash[i];
+    //
+    // debounce, see sample_inputs()
+    //
+    uint32_t cd=(t >= dotdeb[i]) & (rd != kd);
+    uint32_t cs=(t >= dashdeb[i]) & (rs != ks);
+    dd=cd ? t + deb : dd;
+    sd=cs ? t + deb : sd;
+    kd=cd ? rd : kd;
+    ks=cs ? rs : ks;
+    md |= cd & rd;
+    ms |= cs & rs;
+    lp=(cd & rd) ? 0 : lp;
+    lp=(cs & rs) ? 1 : lp;
+    //
+    // ULTIMATIC: the last contact closed wins
+    //
+    uint32_t both=ultimatic[i] & kd & ks;
+    uint32_t ekd=kd & ~(both & lp);
+    uint32_t eks=ks & ~(both & (lp ^ 1));
+    //
+    // keyer state machine, see keyer_state_machine()
+    //
+    uint32_t s=state[i], w=wait[i], down=key[i];
+    uint32_t dh=dash_held[i], oh=dot_held[i];
+    uint32_t due=(t >= w);
+    uint32_t none=(ekd | eks) ^ 1;
+    uint32_t ns=s, nw=w;
+
+    // CHECK
+    uint32_t c0=(s == B_CHECK);
+    ns=(c0 & ekd)               ? B_STARTDOT  : ns;
+    ns=(c0 & (ekd ^ 1) & eks)   ? B_STARTDASH : ns;
+    nw=(c0 & (ekd | eks))       ? t : nw;
+
+    // STARTDOT, STARTDASH
+    uint32_t c1=(s == B_STARTDOT) & due;
+    uint32_t c2=(s == B_STARTDASH) & due;
+    ns=c1 ? B_SENDDOT  : ns;
+    ns=c2 ? B_SENDDASH : ns;
+    ms=c1 ? 0 : ms;
+    md=c2 ? 0 : md;
+    dh=c1 ? eks : dh;
+    oh=c2 ? ekd : oh;
+    nw=c1 ? w + dl : nw;           // chained to the previous deadline
+    nw=c2 ? w + sl : nw;
+    down=(c1 | c2) ? 1 : down;
+
+    // SENDDOT, SENDDASH
+    uint32_t c3=(s == B_SENDDOT) & due;
+    uint32_t c4=(s == B_SENDDASH) & due;
+    ns=c3 ? B_DOTDELAY  : ns;
+    ns=c4 ? B_DASHDELAY : ns;
+    nw=(c3 | c4) ? w + pl : nw;
+    down=(c3 | c4) ? 0 : down;
+
+    // DOTDELAY
+    uint32_t c5=(s == B_DOTDELAY) & due;
+    dh=(c5 & none & ia) ? 0 : dh;
+    uint32_t c5dash=c5 & (ms | eks | dh);
+    uint32_t c5dot =c5 & (c5dash ^ 1) & ekd;
+    uint32_t c5end =c5 & (c5dash ^ 1) & (ekd ^ 1);
+    ns=c5dash ? B_STARTDASH : ns;
+    ns=c5dot  ? B_STARTDOT  : ns;
+    ns=c5end  ? B_CHECK     : ns;
+    nw=c5end  ? w + hg - pl : nw;
+
+    // DASHDELAY (note: strict comparison, as in the sketch)
+    uint32_t c6=(s == B_DASHDELAY) & (t > w);
+    oh=(c6 & none & ia) ? 0 : oh;
+    uint32_t c6dot =c6 & (md | ekd | oh);
+    uint32_t c6dash=c6 & (c6dot ^ 1) & eks;
+    uint32_t c6end =c6 & (c6dot ^ 1) & (eks ^ 1);
+    ns=c6dot  ? B_STARTDOT  : ns;
+    ns=c6dash ? B_STARTDASH : ns;
+    ns=c6end  ? B_CHECK     : ns;
+    nw=c6end  ? w + hg - pl : nw;
+
+    h=(down != key[i]) ? batch_hash(h, t, down) : h;
+    ndot[i]  += c1;
+    ndash[i] += c2;
+
+    hash[i]=h;
+    dotdeb[i]=dd;
+    dashdeb[i]=sd;
+    state[i]=ns;
+    wait[i]=nw;
+    key[i]=down;
+    kdot[i]=kd;
+    kdash[i]=ks;
+    memdot[i]=md;
+    memdash[i]=ms;
+    lastpressed[i]=lp;
+    dot_held[i]=oh;
+    dash_held[i]=dh;
+  }
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Build a hostsim binary from TeensyWinkeyEmulator.ino
+#
+# usage: ./build.sh [name [compiler flags]]
+#
+# e.g.   ./build.sh hostsim -O2
+#        ./build.sh hostsim16 -O2 -DTICK16
+#
+# The binary goes to build/<name>. The sketch is compiled with the
+# config.h file from this directory (not the one from the sketch folder).
+#
+set -e
+cd "$(dirname "$0")"
+name=${1:-hostsim}
+[ $# -gt 0 ] && shift
+mkdir -p build/$name.d
+python3 mkprotos.py ../../TeensyWinkeyEmulator.ino > build/$name.d/protos.h
+cp config.h build/$name.d/config.h
+{
+  echo '#include <Arduino.h>'
+  echo '#include "config.h"'
+  echo '#include "protos.h"'
+  echo '#line 1 "TeensyWinkeyEmulator.ino"'
+  cat ../../TeensyWinkeyEmulator.ino
+} > build/$name.d/sketch.cpp
+${CXX:-g++} -std=gnu++17 -Wall -Wno-unused-function -Wno-unused-variable \
+    -I. -Ibuild/$name.d "$@" -o build/$name hostsim.cpp
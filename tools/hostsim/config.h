@@ -0,0 +1,14 @@
+////////////////////////////////////////////////////////////////////////////
+//
+// config.h file for hostsim: paddle, straight key, one CW and one PTT
+// output, and the serial line to the host. Nothing else.
+//
+////////////////////////////////////////////////////////////////////////////
+
+#define MYSERIAL Serial
+
+#define PaddleRight              2   // Digital input for right paddle
+#define PaddleLeft               3   // Digital input for left paddle
+#define StraightKey              4   // Digital input for straight key
+#define CW1                      6   // Digital output (active high) for CW key-down
+#define PTT1                     8   // Digital output (active high) for PTT on/off
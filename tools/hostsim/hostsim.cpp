@@ -0,0 +1,534 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// hostsim: run the keyer of TeensyWinkeyEmulator.ino on a PC
+//
+// The sketch is compiled into this file (see build.sh), so the driver
+// can look at all (static) variables and call all functions of the sketch.
+// Time is simulated: it only advances when the driver says so, therefore
+// the key-down/up time line produced is exactly reproducible.
+//
+// usage: hostsim bench [wpm [seconds]]
+//
+//        Send a text from the character buffer for the given time (default:
+//        30 wpm, 600 sec), calling the keyer state machine four times per
+//        (simulated) milli-second, as the sketch does on a slow AVR.
+//        Reports the average cost of one call in nano-seconds (host CPU
+//        time) and a check sum of the key-down/up time line, which must
+//        agree for two builds that behave the same.
+//
+//        hostsim timeline [wpm [seconds]]
+//
+//        Same as bench, but prints the key-down/up time line, one line
+//        per event: "<msec> <0|1>".
+//
+//        hostsim ticks [wpm [seconds]]
+//
+//        Same as bench, but counts the time comparisons (REACHED/PASSED)
+//        per call and estimates the AVR cycles they cost with 32-bit and
+//        with 16-bit time-stamps (TICK16), see tick_cost().
+//
+//        hostsim drift [wpm [maxstall]]
+//
+//        Send the bench text until 2000 key-down events have been produced,
+//        once with the keyer called every msec and once with the loop
+//        stalled now and then for up to maxstall msec (default: 5), as
+//        it happens when serial or audio processing takes a while.
+//        Reports the time needed in both cases (that is, the change in
+//        effective speed), the maximum lateness seen by the sketch, and
+//        the number of garbled (shorter than half a dot) elements, which
+//        must be zero also for stalls longer than one element.
+//
+//        hostsim bufptr [chars]
+//
+//        Stream text (default: 1000 characters) from the host through the
+//        WinKey parser while the keyer sends it at 10 wpm, keeping about 100
+//        characters queued so the buffer never runs empty. After each
+//        character, POINTER commands are sent: "append at the end" must not
+//        change the buffer, and "overwrite at the last position" must
+//        replace the last character. Every 50 characters, three NULs are
+//        queued in overwrite mode at the last position: one overwrites,
+//        two are appended. Reports the number of failures.
+//
+//        hostsim pty [loop_us]
+//
+//        Run the whole sketch (setup and loop) in real time, with the
+//        serial port connected to a pseudo-terminal whose name is printed.
+//        Host programs (e.g. tools/wklat) can talk to it as to a real
+//        device. loop_us (default: 0) is a pause after each loop() to
+//        model a slower processor.
+//
+//        hostsim batch [lanes [seconds]]
+//
+//        Run many paddle keyers with synthetic operators in the batch
+//        simulator (see batch.h, default: 10000 lanes, 60 sec). Reports
+//        keyer-steps per second, checks the first 100 lanes against the
+//        keyer of the sketch, and prints some statistics per paddle mode.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "EEPROM.h"
+
+uint64_t   hostsim_us=0;
+uint8_t    hostsim_pin[HOSTSIM_NPINS];
+HostSerial Serial;
+HostEEPROM EEPROM;
+
+static unsigned long tick_cmps=0;       // time comparisons done by the sketch
+#define TICK_PROBE(x) (tick_cmps++, (x))
+
+#include "sketch.cpp"
+#include "batch.h"
+
+//
+// key-down/up time line: hashed (FNV-1a) and optionally printed
+//
+static uint32_t tl_hash=2166136261u;
+static unsigned long tl_events=0;
+static int tl_print=0;
+static int tl_batch=0;                  // hash for batch check, see batch.h
+static unsigned long tl_base;           // start of lane in batch check
+
+static unsigned long tl_last;           // time of last key-down
+static unsigned long tl_minlen=0;       // key-down shorter than this is counted as garbled
+static unsigned long tl_short=0;        // number of such key-down events
+
+static void tl_add(uint32_t v) {
+  for (int i=0; i<4; i++) {
+    tl_hash ^= (v >> (8*i)) & 0xFF;
+    tl_hash *= 16777619u;
+  }
+}
+
+void hostsim_pin_changed(int pin, int val) {
+  if (pin != CW1) return;
+  if (tl_batch) {
+    tl_hash=batch_hash(tl_hash, millis() - tl_base + BATCH_T0, val);
+    return;
+  }
+  tl_add((uint32_t) millis());
+  tl_add(val);
+  tl_events++;
+  if (val) tl_last=millis();
+  if (!val && millis() - tl_last < tl_minlen) tl_short++;
+  if (tl_print > 0) printf("%lu %d\n", millis(), val);
+}
+
+//
+// bytes to the host, only used in pty mode
+//
+static uint8_t to_host[HOSTSIM_SERLEN];
+static int to_host_len=0;
+
+void hostsim_to_host(uint8_t c) {
+  if (to_host_len < HOSTSIM_SERLEN) to_host[to_host_len++]=c;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1e9*ts.tv_sec + ts.tv_nsec;
+}
+
+//
+// Text sent in bench mode, includes buffered-speed changes and a prosign
+//
+static const char bench_text[]="CQ CQ DE DL1YCF DL1YCF [TEST] 5NN$TT1 \x1b" "AR= ";
+
+//
+// AVR cycles for one time comparison, both time-stamps in SRAM
+// (avr-gcc: lds for each byte, cp/cpc, branch):
+// 32 bit: 8 x lds (16) + 4 x cp/cpc (4) + branch (2)
+// 16 bit: 4 x lds  (8) + 2 x cp/cpc (2) + branch (2)
+// Comparisons with an added interval (last + 2*dotlen) and the stores
+// (wait=wait+dotlen) save more, so the saving given is a lower bound.
+//
+#define AVR_CMP32 22
+#define AVR_CMP16 12
+
+static void tick_cost(unsigned long calls) {
+  double n=(double) tick_cmps/calls;
+  printf("calls:       %lu\n", calls);
+  printf("cmp/call:    %.2f\n", n);
+  printf("AVR cycles:  %.1f (32 bit), %.1f (16 bit) per call\n", n*AVR_CMP32, n*AVR_CMP16);
+  printf("saved:       %.1f cycles per call, %.1f%% of a 16 MHz AVR at 4 calls/msec\n",
+         n*(AVR_CMP32-AVR_CMP16), 100.0*4*n*(AVR_CMP32-AVR_CMP16)/16000.0);
+}
+
+static int bench(int wpm, int seconds) {
+  unsigned long calls=0;
+  const char *p=bench_text;
+  double t0, t1;
+
+  setup();
+  Speed=wpm;
+  hostsim_us=1000000;      // start at t=1 sec
+
+  t0=now_ns();
+  tick_cmps=0;
+  for (long ms=0; ms < 1000L*seconds; ms++) {
+    hostsim_us += 1000;
+    while (bufcount() < 16) {
+      if (*p == 0x1b) {
+        p++;
+        queue(1, PROSIGN, 0, 0);
+      }
+      queue(1, *p++, 0, 0);
+      if (*p == 0) p=bench_text;
+    }
+    for (int i=0; i<4; i++) {
+      actual=millis();
+      sample_inputs();
+      keyer_state_machine();
+      calls++;
+    }
+  }
+  t1=now_ns();
+
+  if (tl_print < 0) {
+    tick_cost(calls);
+  } else if (!tl_print) {
+    printf("calls:      %lu\n", calls);
+    printf("ns/call:    %.2f\n", (t1-t0)/calls);
+    printf("key events: %lu\n", tl_events);
+    printf("time line:  %08x\n", tl_hash);
+  }
+  return 0;
+}
+
+//
+// Send the bench text until the given number of key events, with random
+// stalls of up to maxstall msec. Returns the time from the first to the
+// last key-down.
+//
+static unsigned long drift_run(int wpm, int maxstall, unsigned long events) {
+  const char *p=bench_text;
+  uint32_t rng=12345;
+  int stall=0;
+  unsigned long first=0;
+
+  clearbuf();
+  keyup();
+  keyer_state=CHECK;
+  Speed=wpm;
+  tl_events=0;
+  hostsim_us += 1000000;
+  while (tl_events < events) {
+    hostsim_us += 1000;
+    while (bufcount() < 16) {
+      if (*p == 0x1b) {
+        p++;
+        queue(1, PROSIGN, 0, 0);
+      }
+      queue(1, *p++, 0, 0);
+      if (*p == 0) p=bench_text;
+    }
+    if (stall > 0) {
+      stall--;
+      continue;
+    }
+    for (int i=0; i<4; i++) {
+      actual=millis();
+      sample_inputs();
+      keyer_state_machine();
+    }
+    if (tl_events == 1 && first == 0) first=tl_last;
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    if (maxstall > 0 && rng % 20 == 0) stall=(rng >> 8) % maxstall + 1;
+  }
+  return tl_last - first;
+}
+
+static int drift(int wpm, int maxstall) {
+  const unsigned long events=4000;      // 2000 key-down, 2000 key-up
+  unsigned long t0, t1;
+
+  setup();
+  tl_minlen=1200/(wpm > 40 ? wpm : 40)/2;  // half a dot ("[" in the text: 40 wpm)
+  t0=drift_run(wpm, 0, events);
+  late_max=0;
+  tl_short=0;
+  t1=drift_run(wpm, maxstall, events);
+  printf("no stalls:    %lu msec\n", t0);
+  printf("with stalls:  %lu msec (%+.2f%%)\n", t1, 100.0*((double) t1-t0)/t0);
+  printf("max lateness: %d msec\n", late_max);
+  printf("short elements: %lu (key-down shorter than half a dot)\n", tl_short);
+  return tl_short ? 1 : 0;
+}
+
+//
+// Pointer commands while streaming more than 256 characters
+//
+static void bufptr_run(const uint8_t *b, int n) {
+  for (int i=0; i<n; i++) Serial.put(b[i]);
+  for (int i=0; i<4 || Serial.available(); i++) {
+    hostsim_us += 1000;
+    loop();
+  }
+}
+
+static int bufptr(int chars) {
+  static const uint8_t open[]={0x00, 0x02, 0x02, 10};   // host open, 10 wpm
+  int bad=0;
+
+  for (int i=0; i<HOSTSIM_NPINS; i++) hostsim_pin[i]=HIGH;
+  hostsim_us=1000000;
+  setup();
+  bufptr_run(open, sizeof(open));
+  for (int n=0; n<chars; n++) {
+    while (bufcount() >= 100) {
+      hostsim_us += 1000;
+      loop();
+    }
+    uint8_t c='A' + n % 26;
+    bufptr_run(&c, 1);
+    uint8_t tx=buftx;
+    //
+    // append mode at a position beyond the end: nothing changes
+    //
+    uint8_t append[]={0x16, 0x02, 0xFF};
+    bufptr_run(append, sizeof(append));
+    if (buftx != tx) {
+      if (bad++ < 5) printf("char %d: append at end moved buftx by %d\n", n, (int8_t) (buftx-tx));
+      continue;
+    }
+    //
+    // overwrite the last character (positions count from 1),
+    // if it cannot have been sent yet
+    //
+    if (bufcount() < 10) continue;
+    uint8_t over[]={0x16, 0x01, (uint8_t) (buftx - bufbase), (uint8_t) (c | 0x20)};
+    bufptr_run(over, sizeof(over));
+    if (buftx != tx || character_buffer[(uint8_t) (tx-1) & (BUFLEN-1)] != (c | 0x20) || bufovr) {
+      if (bad++ < 5) printf("char %d: overwrite of the last character failed\n", n);
+      continue;
+    }
+    //
+    // now and then: overwrite mode runs into the end of the buffer
+    // while queueing three NULs, two of them must be appended
+    //
+    if (n % 50 || bufcount() > BUFLEN-2) continue;
+    uint8_t zero[]={0x16, 0x01, (uint8_t) (buftx - bufbase), 0x16, 0x03, 3};
+    bufptr_run(zero, sizeof(zero));
+    if (buftx != (uint8_t) (tx+2) || character_buffer[(uint8_t) (tx-1) & (BUFLEN-1)] != 0 || bufovr) {
+      if (bad++ < 5) printf("char %d: NULs in overwrite mode: buftx moved by %d\n", n, (int8_t) (buftx-tx));
+    }
+  }
+  printf("bufptr:     %d characters, %d failures\n", chars, bad);
+  return bad ? 1 : 0;
+}
+
+//
+// Real-time run with the serial port on a pseudo-terminal
+//
+static int pty(int loop_us) {
+  int fd;
+  uint8_t buf[256];
+  double t0;
+
+  fd=posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+    perror("pty");
+    return 1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  printf("%s\n", ptsname(fd));
+  fflush(stdout);
+
+  for (int i=0; i<HOSTSIM_NPINS; i++) hostsim_pin[i]=HIGH;   // keys not pressed
+  t0=now_ns();
+  hostsim_us=1000000;
+  setup();
+  to_host_len=0;
+  for (;;) {
+    hostsim_us=1000000 + (uint64_t) ((now_ns()-t0)/1000);
+    int n=read(fd, buf, sizeof(buf));
+    if (n > 0) {
+      for (int i=0; i<n; i++) Serial.put(buf[i]);
+    } else if (n < 0 && errno == EIO) {
+      usleep(10000);                // no host connected
+      continue;
+    }
+    loop();
+    if (to_host_len > 0) {
+      if (write(fd, to_host, to_host_len) < 0 && errno != EAGAIN) {
+        perror("write");
+      }
+      to_host_len=0;
+    }
+    if (loop_us > 0) usleep(loop_us);
+  }
+  return 0;
+}
+
+//
+// paddle modes used in batch mode, as ModeRegister bits
+//
+static const uint8_t batch_modes[3]={0x00, 0x10, 0x20};
+static const char *batch_mode_names[3]={"iambic-B", "iambic-A", "ultimatic"};
+
+//
+// Run lane i of batch b through the scalar keyer of the sketch, starting
+// at time base, and return the hash of the key-down/up time line.
+//
+static uint32_t batch_scalar(Batch *b, int i, uint8_t speed, uint8_t mode, long steps, unsigned long base) {
+  Batch op;
+
+  batch_init(&op, 1);
+  op.rng[0]=i+1;
+  op.op_unit[0]=b->op_unit[i];
+  op.op_bouncelen[0]=b->op_bouncelen[i];
+
+  tl_batch=0;
+  keyup();
+  keyer_state=CHECK;
+  kdot=kdash=memdot=memdash=dot_held=dash_held=lastpressed=0;
+  pdot=pdash=softpad=0;
+  in_rx=in_tx;
+  collecting=collpos=0;
+  ModeRegister=mode;
+  paddle_mode_select();
+  Speed=speed;
+
+  tl_batch=1;
+  tl_hash=0;
+  tl_base=base;
+  for (long k=0; k<steps; k++) {
+    hostsim_us=1000ULL*(base+k);
+    op_step(&op, 0, 1);
+    hostsim_pin[PaddleLeft]=!op.rawdot[0];
+    hostsim_pin[PaddleRight]=!op.rawdash[0];
+    actual=millis();
+    sample_inputs();
+    keyer_state_machine();
+  }
+  tl_batch=0;
+  return tl_hash;
+}
+
+static int batch(int lanes, int seconds) {
+  Batch b;
+  uint8_t *speed, *mode;
+  long steps=1000L*seconds;
+  double t0, t1, tkeyer=0;
+  int nchk, bad=0;
+
+  setup();
+  batch_init(&b, lanes);
+  speed=(uint8_t *) calloc(lanes, 1);
+  mode=(uint8_t *) calloc(lanes, 1);
+  //
+  // lane parameters: speed 15-40 wpm, paddle mode, 0-4 msec contact bounce.
+  // The timing is computed by the sketch.
+  //
+  for (int i=0; i<lanes; i++) {
+    speed[i]=15 + (i*7) % 26;
+    mode[i]=i % 3;
+    ModeRegister=batch_modes[mode[i]];
+    compute_timing(speed[i]);
+    b.dotlen[i]=dotlen;
+    b.dashlen[i]=dashlen;
+    b.plen[i]=plen;
+    b.hang[i]=hang;
+    b.iambic_a[i]=IAMBIC_A ? 1 : 0;
+    b.ultimatic[i]=ULTIMATIC ? 1 : 0;
+    b.rng[i]=i+1;
+    b.op_unit[i]=2*dotlen;
+    b.op_bouncelen[i]=(i/3) % 5;
+  }
+
+  t0=now_ns();
+  for (long k=0; k<steps; k++) {
+    double tk;
+    op_step(&b, 0, lanes);
+    tk=now_ns();
+    keyer_step(&b, BATCH_T0+k);
+    tkeyer += now_ns()-tk;
+  }
+  t1=now_ns();
+
+  printf("lanes:             %d\n", lanes);
+  printf("steps per lane:    %ld\n", steps);
+  printf("keyer-steps/sec:   %.3g\n", (double) lanes*steps/tkeyer*1e9);
+  printf("total steps/sec:   %.3g   (including synthetic operators)\n", (double) lanes*steps/(t1-t0)*1e9);
+
+  //
+  // check against the keyer of the sketch
+  //
+  nchk=lanes < 100 ? lanes : 100;
+  t0=now_ns();
+  for (int i=0; i<nchk; i++) {
+    unsigned long base=BATCH_T0 + (unsigned long) i*(steps+1000);
+    if (batch_scalar(&b, i, speed[i], batch_modes[mode[i]], steps, base) != b.hash[i]) {
+      printf("lane %d: time line differs from scalar keyer\n", i);
+      bad++;
+    }
+  }
+  t1=now_ns();
+  printf("scalar steps/sec:  %.3g\n", (double) nchk*steps/(t1-t0)*1e9);
+  printf("scalar check:      %d lanes, %s\n", nchk, bad ? "FAILED" : "OK");
+
+  for (int m=0; m<3; m++) {
+    double dots=0, dashes=0;
+    int cnt=0;
+    for (int i=0; i<lanes; i++) {
+      if (mode[i] != m) continue;
+      dots += b.ndot[i];
+      dashes += b.ndash[i];
+      cnt++;
+    }
+    if (cnt > 0) {
+      printf("%-10s %6d lanes, per lane and minute: %7.1f dots %7.1f dashes\n",
+             batch_mode_names[m], cnt, 60*dots/cnt/seconds, 60*dashes/cnt/seconds);
+    }
+  }
+  return bad ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  int wpm=30, seconds=600;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s bench|timeline|ticks [wpm [seconds]]\n", argv[0]);
+    fprintf(stderr, "       %s drift [wpm [maxstall]]\n", argv[0]);
+    fprintf(stderr, "       %s bufptr [chars]\n", argv[0]);
+    fprintf(stderr, "       %s pty [loop_us]\n", argv[0]);
+    fprintf(stderr, "       %s batch [lanes [seconds]]\n", argv[0]);
+    return 1;
+  }
+  if (!strcmp(argv[1], "pty")) {
+    return pty(argc > 2 ? atoi(argv[2]) : 0);
+  }
+  if (!strcmp(argv[1], "bufptr")) {
+    return bufptr(argc > 2 ? atoi(argv[2]) : 1000);
+  }
+  if (!strcmp(argv[1], "drift")) {
+    return drift(argc > 2 ? atoi(argv[2]) : 30, argc > 3 ? atoi(argv[3]) : 5);
+  }
+  if (!strcmp(argv[1], "batch")) {
+    return batch(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 60);
+  }
+  if (argc > 2) wpm=atoi(argv[2]);
+  if (argc > 3) seconds=atoi(argv[3]);
+
+  if (!strcmp(argv[1], "bench")) {
+    return bench(wpm, seconds);
+  }
+  if (!strcmp(argv[1], "timeline")) {
+    tl_print=1;
+    return bench(wpm, seconds);
+  }
+  if (!strcmp(argv[1], "ticks")) {
+    tl_print=-1;
+    return bench(wpm, seconds);
+  }
+  fprintf(stderr, "unknown command: %s\n", argv[1]);
+  return 1;
+}
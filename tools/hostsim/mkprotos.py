@@ -0,0 +1,16 @@
+#!/usr/bin/env python3
+#
+# Write prototypes for all functions defined in the sketch to stdout.
+# This is what the Arduino IDE does before compiling a .ino file, since
+# the sketch uses many functions before they are defined.
+#
+import re, sys
+
+src = open(sys.argv[1]).read()
+pat = re.compile(r'^((?:static\s+|inline\s+)*(?:unsigned\s+|const\s+)?[A-Za-z_]\w*[\s\*&]+)'
+                 r'([A-Za-z_]\w*)\s*\(([^;{()]*)\)\s*\{', re.M)
+for m in pat.finditer(src):
+    ret, name, args = m.group(1), m.group(2), m.group(3)
+    if name in ('if', 'while', 'for', 'switch', 'ISR') or ret.strip() in ('return', 'else', 'case', 'new'):
+        continue
+    print('%s%s(%s);' % (ret, name, args))
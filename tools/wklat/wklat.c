@@ -0,0 +1,276 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// wklat: measure how fast a WinKey (emulator) answers the host
+//
+// usage: wklat [-n count] [-w window] [-b baud] [-o file.csv] device
+//
+// The device is a serial port (e.g. /dev/ttyACM0) or the pseudo-terminal
+// of "hostsim pty". After opening host mode (ADMIN_OPEN), three tests
+// are run:
+//
+// echo:       count times ADMIN_ECHO (0x00 0x04 <b>), each time waiting
+//             for <b> before sending the next one
+// status:     count times "request status" (0x15), each time waiting for
+//             the status byte
+// throughput: count ADMIN_ECHO commands, with up to <window> (default: 8)
+//             of them outstanding at any time
+//
+// For echo and status, the round-trip time distribution (p50, p99, max)
+// is printed, for throughput the number of commands per second. With -o,
+// every single round-trip time goes to a CSV file (test,seq,usec).
+//
+// Note: status bytes (0xC0-0xFF) and speed pot reports (0x80-0xBF) may
+// arrive at any time, they are skipped while waiting for an echo.
+//
+// Compile with:  cc -O2 -o wklat wklat.c
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMEOUT_MS 1000
+
+static int fd;
+static FILE *csv=NULL;
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1e6*ts.tv_sec + 1e-3*ts.tv_nsec;
+}
+
+static speed_t baudrate(int baud) {
+  switch (baud) {
+    case 1200:   return B1200;
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+  }
+  fprintf(stderr, "unsupported baud rate %d, using 1200\n", baud);
+  return B1200;
+}
+
+static int open_device(const char *name, int baud) {
+  struct termios tio;
+
+  fd=open(name, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(name);
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cflag |= CSTOPB;                 // WinKey: 1200 baud, 8N2
+    tio.c_cc[VMIN]=0;
+    tio.c_cc[VTIME]=0;
+    cfsetispeed(&tio, baudrate(baud));
+    cfsetospeed(&tio, baudrate(baud));
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIOFLUSH);
+  return 0;
+}
+
+static void send_bytes(const uint8_t *b, int n) {
+  while (n > 0) {
+    int k=write(fd, b, n);
+    if (k < 0) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      perror("write");
+      exit(1);
+    }
+    b += k;
+    n -= k;
+  }
+}
+
+//
+// Read one byte, return -1 on time-out
+//
+static int read_byte(int timeout_ms) {
+  struct pollfd p;
+  uint8_t c;
+
+  p.fd=fd;
+  p.events=POLLIN;
+  for (;;) {
+    int rc=poll(&p, 1, timeout_ms);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return -1;
+    rc=read(fd, &c, 1);
+    if (rc == 1) return c;
+    if (rc < 0 && errno != EAGAIN && errno != EINTR) return -1;
+  }
+}
+
+//
+// Wait for a byte that is neither a status byte nor a speed pot report
+//
+static int read_echo(int timeout_ms) {
+  int c;
+  do {
+    c=read_byte(timeout_ms);
+  } while (c >= 0x80);
+  return c;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x=*(const double *)a, y=*(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char *test, double *t, int n, int lost) {
+  if (n == 0) {
+    printf("%-10s no answers (%d lost)\n", test, lost);
+    return;
+  }
+  qsort(t, n, sizeof(double), cmp_double);
+  printf("%-10s n=%d lost=%d  p50=%.0f us  p99=%.0f us  max=%.0f us\n",
+         test, n, lost, t[n/2], t[(int) (0.99*(n-1))], t[n-1]);
+}
+
+static void echo_test(int count, double *t) {
+  int n=0, lost=0;
+
+  for (int i=0; i<count; i++) {
+    uint8_t b[3]={0x00, 0x04, (uint8_t) (0x20 + i % 95)};
+    double t0=now_us();
+    int c;
+    send_bytes(b, 3);
+    //
+    // skip late echoes of earlier (lost) samples until the
+    // expected byte arrives or the time-out expires
+    //
+    do {
+      int left=TIMEOUT_MS - (int) ((now_us()-t0)/1000);
+      c=left > 0 ? read_echo(left) : -1;
+    } while (c >= 0 && c != b[2]);
+    if (c < 0) {
+      lost++;
+      continue;
+    }
+    t[n]=now_us()-t0;
+    if (csv) fprintf(csv, "echo,%d,%.1f\n", i, t[n]);
+    n++;
+  }
+  report("echo", t, n, lost);
+}
+
+static void status_test(int count, double *t) {
+  int n=0, lost=0;
+
+  for (int i=0; i<count; i++) {
+    uint8_t b=0x15;
+    int c;
+    double t0=now_us();
+    send_bytes(&b, 1);
+    do {
+      c=read_byte(TIMEOUT_MS);
+    } while (c >= 0 && (c & 0xC0) != 0xC0);
+    if (c < 0) {
+      lost++;
+      continue;
+    }
+    t[n]=now_us()-t0;
+    if (csv) fprintf(csv, "status,%d,%.1f\n", i, t[n]);
+    n++;
+  }
+  report("status", t, n, lost);
+}
+
+static void throughput_test(int count, int window) {
+  int sent=0, done=0, lost=0;
+  double t0=now_us(), t1;
+
+  while (done + lost < count) {
+    while (sent < count && sent - done - lost < window) {
+      uint8_t b[3]={0x00, 0x04, (uint8_t) (0x20 + sent % 95)};
+      send_bytes(b, 3);
+      sent++;
+    }
+    int c=read_echo(TIMEOUT_MS);
+    if (c < 0) {
+      lost += sent - done - lost;     // give up on all outstanding
+      continue;
+    }
+    //
+    // Echoes come back in order: if this one is ahead of the expected
+    // one, those in between are lost. Bytes that match no outstanding
+    // command (e.g. late echoes of commands given up on) are ignored.
+    //
+    int ahead=(c - 0x20 - (done + lost) % 95 + 95) % 95;
+    if (c < 0x20 || c >= 0x20 + 95 || ahead >= sent - done - lost) continue;
+    lost += ahead;
+    done++;
+  }
+  t1=now_us();
+  printf("%-10s n=%d lost=%d  window=%d  %.0f commands/sec\n",
+         "throughput", done, lost, window, 1e6*done/(t1-t0));
+  if (csv) fprintf(csv, "throughput,%d,%.1f\n", done, t1-t0);
+}
+
+int main(int argc, char **argv) {
+  int count=1000, window=8, baud=1200, opt, c;
+  const char *csvname=NULL;
+  double *t;
+
+  while ((opt=getopt(argc, argv, "n:w:b:o:")) != -1) {
+    switch (opt) {
+      case 'n': count=atoi(optarg); break;
+      case 'w': window=atoi(optarg); break;
+      case 'b': baud=atoi(optarg); break;
+      case 'o': csvname=optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-n count] [-w window] [-b baud] [-o file.csv] device\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc || count <= 0 || window <= 0) {
+    fprintf(stderr, "usage: %s [-n count] [-w window] [-b baud] [-o file.csv] device\n", argv[0]);
+    return 1;
+  }
+  if (open_device(argv[optind], baud) < 0) return 1;
+  if (csvname) {
+    csv=fopen(csvname, "w");
+    if (!csv) {
+      perror(csvname);
+      return 1;
+    }
+    fprintf(csv, "test,seq,usec\n");
+  }
+  t=(double *) malloc(count*sizeof(double));
+
+  //
+  // open host mode, the answer is the version number
+  //
+  send_bytes((const uint8_t *) "\x00\x02", 2);
+  c=read_echo(TIMEOUT_MS);
+  if (c < 0) {
+    fprintf(stderr, "no answer to ADMIN_OPEN\n");
+    return 1;
+  }
+  printf("version:   %d\n", c);
+  usleep(100000);
+  tcflush(fd, TCIFLUSH);               // initial status and speed pot reports
+
+  echo_test(count, t);
+  status_test(count, t);
+  throughput_test(count, window);
+
+  send_bytes((const uint8_t *) "\x00\x03", 2);
+  if (csv) fclose(csv);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,434 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// wkmsg: build the EEPROM message area, with messages sharing their tails
+//
+// usage: wkmsg [-n] [-i image] [-o image] [-d device] [-b baud] [msg1 ... msg6]
+//
+// The six standalone messages live in the EEPROM at addresses 24-255
+// (232 bytes), the pointers to them at addresses 18-23. Each character is
+// stored as its dot/dash pattern (as in the sketch: read from bit 0, the
+// highest bit set marks the end), 0x1c is a word space, and the last
+// character of a message has bit 7 set.
+//
+// As a protocol extension of this keyer, 0x00 <addr> continues a message
+// at address <addr>. wkmsg uses this to store a tail that several messages
+// have in common (say, " TU DL1YCF") only once: each message is stored
+// as its own beginning plus such a jump (2 bytes), or, if it is the tail
+// of a message already stored, it just points into that message (0 bytes).
+// Messages without a shared tail are stored as before, so images without
+// sharing (-n) can be used with any WinKey.
+//
+// The image (256 bytes) starts as a copy of the EEPROM of the keyer (-d,
+// read with DUMPEEPROM), or of a file (-i), or all zero. The message area,
+// the pointers and the "free pointer" (address 17) are replaced, and every
+// message is played back from the new image (following the jumps) and
+// compared with the input. The image is written to a file (-o) and/or
+// to the keyer (-d, with LOADEEPROM, then read back and compared).
+// Without messages, the messages found in the image are listed.
+//
+// Allowed characters: A-Z, 0-9, space and " ' ( ) + , - . / : = ? @
+// (lower case is converted to upper case). An empty message ("") is
+// stored as "no message" (pointer 0).
+//
+// Compile with:  cc -O2 -o wkmsg wkmsg.c
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define NMSG       6
+#define MSGPTR    18               // EEPROM address of the first message pointer
+#define FREEPTR   17               // EEPROM address of the "free pointer"
+#define MSGSTART  24               // first byte of the message area
+#define MSGEND   256               // end of the message area
+#define MAXLEN   (MSGEND-MSGSTART)
+#define SPACE   0x1c               // pattern used for a word space
+#define JUMP    0x00               // JUMP <addr>: continue at addr
+#define TIMEOUT_MS 2000
+
+//
+// Morse code for ASCII 33-90, same as in the sketch (0x01: not available)
+//
+static const uint8_t morse[58] = {
+  0x01, 0x52, 0x01, 0x01, 0x01, 0x01, 0x5E, 0x2D,    // ! " # $ % & ' (
+  0x6D, 0x01, 0x2A, 0x73, 0x61, 0x6A, 0x29, 0x3F,    // ) * + , - . / 0
+  0x3E, 0x3C, 0x38, 0x30, 0x20, 0x21, 0x23, 0x27,    // 1 2 3 4 5 6 7 8
+  0x2F, 0x47, 0x01, 0x01, 0x31, 0x01, 0x4C, 0x56,    // 9 : ; < = > ? @
+  0x06, 0x11, 0x15, 0x09, 0x02, 0x14, 0x0B, 0x10,    // A B C D E F G H
+  0x04, 0x1E, 0x0D, 0x12, 0x07, 0x05, 0x0F, 0x16,    // I J K L M N O P
+  0x1B, 0x0A, 0x08, 0x03, 0x0C, 0x18, 0x0E, 0x19,    // Q R S T U V W X
+  0x1D, 0x13                                         // Y Z
+};
+
+static int fd=-1;
+
+static uint8_t image[256];
+static uint8_t msg[NMSG][MAXLEN];  // patterns of the messages, without end bit
+static int     msglen[NMSG];
+static int     nmsg=0;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Characters and patterns
+//
+//////////////////////////////////////////////////////////////////////////////
+
+static int encode(const char *text, uint8_t *out) {
+  int n=0;
+  for (const char *p=text; *p; p++) {
+    int c=*p;
+    uint8_t m;
+    if (c >= 'a' && c <= 'z') c -= 32;
+    if (c == ' ') {
+      m=SPACE;
+    } else if (c >= 33 && c <= 90 && morse[c-33] != 0x01) {
+      m=morse[c-33];
+    } else {
+      fprintf(stderr, "character '%c' not available: \"%s\"\n", *p, text);
+      return -1;
+    }
+    if (n >= MAXLEN) {
+      fprintf(stderr, "message too long: \"%s\"\n", text);
+      return -1;
+    }
+    out[n++]=m;
+  }
+  return n;
+}
+
+static int decode_char(uint8_t m) {
+  if (m == SPACE) return ' ';
+  for (int i=0; i<58; i++) {
+    if (morse[i] == m && m != 0x01) return i+33;
+  }
+  return '~';
+}
+
+//
+// Play a message from the image, as the sketch does: patterns until one
+// has bit 7 set, a JUMP continues at its address (one jump per character,
+// targets within the message area). Returns the number of patterns, or -1
+// if the message is broken.
+//
+static int play(const uint8_t *img, int addr, uint8_t *out) {
+  int n=0;
+  while (addr >= MSGSTART && addr < MSGEND && n < MAXLEN) {
+    uint8_t b=img[addr++];
+    if (b == JUMP) {
+      if (addr >= MSGEND) return -1;
+      addr=img[addr];
+      if (addr < MSGSTART) return -1;
+      b=img[addr++];
+      if (b == JUMP) return -1;
+    }
+    out[n++]=b & 0x7F;
+    if (b & 0x80) return n;
+  }
+  return -1;
+}
+
+static void print_patterns(const uint8_t *p, int n) {
+  for (int i=0; i<n; i++) putchar(decode_char(p[i]));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Layout
+//
+// Messages are placed longest first. For each one, the longest tail that
+// some already stored character position plays is searched for. If that
+// is the whole message, the pointer goes there; if it is longer than
+// the jump (2 bytes), the message is stored as its head plus a jump;
+// otherwise completely. Jumps always go to a character, never to another
+// jump, so there is at most one jump per character when playing.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+static int layout(uint8_t *img, int share, int *ptr, int *bytes) {
+  int order[NMSG], top=MSGSTART;
+  uint8_t play_buf[MAXLEN];
+  uint8_t is_char[MSGEND];
+
+  memset(img+MSGSTART, 0, MAXLEN);
+  memset(is_char, 0, sizeof(is_char));
+  for (int i=0; i<NMSG; i++) order[i]=i;
+  for (int i=0; i<NMSG; i++) {
+    for (int j=i+1; j<NMSG; j++) {
+      if (msglen[order[j]] > msglen[order[i]]) {
+        int t=order[i]; order[i]=order[j]; order[j]=t;
+      }
+    }
+  }
+
+  for (int k=0; k<NMSG; k++) {
+    int i=order[k], n=msglen[i];
+    int best=0, bestpos=0;
+    ptr[i]=0;
+    bytes[i]=0;
+    if (n == 0) continue;
+    if (share) {
+      for (int p=MSGSTART; p<top; p++) {
+        if (!is_char[p]) continue;
+        int len=play(img, p, play_buf);
+        if (len <= best || len > n) continue;
+        if (memcmp(play_buf, msg[i]+n-len, len) == 0) {
+          best=len;
+          bestpos=p;
+        }
+      }
+    }
+    if (best == n) {
+      ptr[i]=bestpos;
+      continue;
+    }
+    int head=(best > 2) ? n-best : n;
+    int need=(best > 2) ? head+2 : n;
+    if (top+need > MSGEND) {
+      fprintf(stderr, "message %d does not fit: needs %d bytes, %d left\n",
+              i+1, need, MSGEND-top);
+      return -1;
+    }
+    ptr[i]=top;
+    bytes[i]=need;
+    for (int j=0; j<head; j++) {
+      is_char[top]=1;
+      img[top++]=msg[i][j];
+    }
+    if (best > 2) {
+      img[top++]=JUMP;
+      img[top++]=bestpos;
+    } else {
+      img[top-1] |= 0x80;
+    }
+  }
+  return top;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Serial line (1200 baud, 8N2, as in tools/wklat)
+//
+//////////////////////////////////////////////////////////////////////////////
+
+static speed_t baudrate(int baud) {
+  switch (baud) {
+    case 1200:   return B1200;
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+  }
+  fprintf(stderr, "unsupported baud rate %d, using 1200\n", baud);
+  return B1200;
+}
+
+static int open_device(const char *name, int baud) {
+  struct termios tio;
+
+  fd=open(name, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(name);
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cflag |= CSTOPB;
+    tio.c_cc[VMIN]=0;
+    tio.c_cc[VTIME]=0;
+    cfsetispeed(&tio, baudrate(baud));
+    cfsetospeed(&tio, baudrate(baud));
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIOFLUSH);
+  return 0;
+}
+
+static void send_bytes(const uint8_t *b, int n) {
+  while (n > 0) {
+    int k=write(fd, b, n);
+    if (k < 0) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      perror("write");
+      exit(1);
+    }
+    b += k;
+    n -= k;
+  }
+}
+
+static int read_byte(int timeout_ms) {
+  struct pollfd p;
+  uint8_t c;
+
+  p.fd=fd;
+  p.events=POLLIN;
+  for (;;) {
+    int rc=poll(&p, 1, timeout_ms);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return -1;
+    rc=read(fd, &c, 1);
+    if (rc == 1) return c;
+    if (rc < 0 && errno != EAGAIN && errno != EINTR) return -1;
+  }
+}
+
+//
+// DUMPEEPROM: the keyer sends all 256 bytes, nothing else in between
+//
+static int dump_eeprom(uint8_t *img) {
+  send_bytes((const uint8_t *) "\x00\x0c", 2);
+  for (int i=0; i<256; i++) {
+    int c=read_byte(TIMEOUT_MS);
+    if (c < 0) {
+      fprintf(stderr, "DUMPEEPROM: no answer after %d bytes\n", i);
+      return -1;
+    }
+    img[i]=c;
+  }
+  return 0;
+}
+
+static void load_eeprom(const uint8_t *img) {
+  send_bytes((const uint8_t *) "\x00\x0d", 2);
+  send_bytes(img, 256);
+  tcdrain(fd);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-n] [-i image] [-o image] [-d device] [-b baud] [msg1 ... msg6]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int share=1, baud=1200, opt;
+  const char *inname=NULL, *outname=NULL, *devname=NULL;
+  int ptr[NMSG], bytes[NMSG], top, plain=0;
+  uint8_t buf[MAXLEN];
+
+  while ((opt=getopt(argc, argv, "ni:o:d:b:")) != -1) {
+    switch (opt) {
+      case 'n': share=0; break;
+      case 'i': inname=optarg; break;
+      case 'o': outname=optarg; break;
+      case 'd': devname=optarg; break;
+      case 'b': baud=atoi(optarg); break;
+      default:  usage(argv[0]);
+    }
+  }
+  nmsg=argc-optind;
+  if (nmsg > NMSG) usage(argv[0]);
+  for (int i=0; i<nmsg; i++) {
+    msglen[i]=encode(argv[optind+i], msg[i]);
+    if (msglen[i] < 0) return 1;
+  }
+
+  //
+  // initial image
+  //
+  memset(image, 0, sizeof(image));
+  image[0]=0xA5;
+  if (inname) {
+    FILE *f=fopen(inname, "rb");
+    if (!f || fread(image, 1, 256, f) != 256) {
+      fprintf(stderr, "%s: cannot read 256 bytes\n", inname);
+      return 1;
+    }
+    fclose(f);
+  }
+  if (devname) {
+    if (open_device(devname, baud) < 0) return 1;
+    send_bytes((const uint8_t *) "\x00\x02", 2);    // open host mode
+    if (read_byte(TIMEOUT_MS) < 0) {
+      fprintf(stderr, "no answer to ADMIN_OPEN\n");
+      return 1;
+    }
+    usleep(100000);
+    tcflush(fd, TCIFLUSH);                           // status and speed pot reports
+    if (dump_eeprom(image) < 0) return 1;
+  }
+
+  if (nmsg == 0) {
+    //
+    // list the messages found in the image
+    //
+    for (int i=0; i<NMSG; i++) {
+      int a=image[MSGPTR+i], n;
+      printf("%d @%3d: ", i+1, a);
+      if (a == 0) {
+        printf("(none)\n");
+        continue;
+      }
+      n=play(image, a, buf);
+      if (n < 0) {
+        printf("(broken)\n");
+      } else {
+        print_patterns(buf, n);
+        putchar('\n');
+      }
+    }
+  } else {
+    //
+    // new message area
+    //
+    for (int i=0; i<NMSG; i++) plain += msglen[i];
+    top=layout(image, share, ptr, bytes);
+    if (top < 0) {
+      fprintf(stderr, "the messages need more than the %d bytes available\n", MAXLEN);
+      return 1;
+    }
+    image[FREEPTR]=top & 0xFF;
+    for (int i=0; i<NMSG; i++) image[MSGPTR+i]=ptr[i];
+
+    for (int i=0; i<NMSG; i++) {
+      int n=ptr[i] ? play(image, ptr[i], buf) : 0;
+      if (n != msglen[i] || memcmp(buf, msg[i], n) != 0) {
+        fprintf(stderr, "internal error: message %d does not play back\n", i+1);
+        return 1;
+      }
+      printf("%d @%3d %3d bytes: ", i+1, ptr[i], bytes[i]);
+      print_patterns(buf, n);
+      putchar('\n');
+    }
+    printf("used: %d of %d bytes (%d without shared tails)\n",
+           top-MSGSTART, MAXLEN, plain);
+  }
+
+  if (outname) {
+    FILE *f=fopen(outname, "wb");
+    if (!f || fwrite(image, 1, 256, f) != 256) {
+      fprintf(stderr, "%s: cannot write\n", outname);
+      return 1;
+    }
+    fclose(f);
+  }
+
+  if (devname) {
+    if (nmsg > 0) {
+      uint8_t check[256];
+      load_eeprom(image);
+      usleep(200000);
+      tcflush(fd, TCIFLUSH);
+      if (dump_eeprom(check) < 0) return 1;
+      if (memcmp(check+1, image+1, 255) != 0) {
+        fprintf(stderr, "read-back differs from the image\n");
+        return 1;
+      }
+      printf("loaded and verified\n");
+    }
+    send_bytes((const uint8_t *) "\x00\x03", 2);    // close host mode
+    close(fd);
+  }
+  return 0;
+}
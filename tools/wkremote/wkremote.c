@@ -0,0 +1,577 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// wkremote: remote keying over UDP
+//
+// usage: wkremote send [-m mididev] [-d device] [-g wpm] [-D delay] [-J jitter]
+//                      [-P loss] [-t seconds] host port
+//        wkremote recv [-d device] [-M margin] [-l] [-t seconds] [-o file.csv] port
+//
+// "send" runs at the operator's site. It reads the paddle and straight key
+// contacts from the keyer (MIDI_PADDLES: the contacts come as MIDI notes
+// 4, 5, 6 on the raw MIDI device, e.g. /dev/snd/midiC1D0), time-stamps each
+// change when it arrives and sends it to the remote site. With -d, the
+// keyer is switched to "raw" mode through its serial port (admin command
+// 0x00 0x38 1) and back at the end. For tests, -g wpm replaces the keyer by
+// a synthetic operator (random dots, dashes and pauses).
+//
+// Each packet carries the send time and the last (up to) four events, each
+// with its time stamp and the complete contact state, so a lost packet is
+// usually repaired by the next one. A packet with a new event is repeated
+// twice (after 10 and 20 msec), and if nothing happens, the last events are
+// repeated every 50 msec. Network impairments can be injected for tests:
+// -D fixed delay, -J additional random delay 0 ... jitter, -P loss (percent),
+// all in msec (packets may then be re-ordered).
+//
+// "recv" runs at the transmitter's site. Every event is played at
+//
+//          (time stamp) + (clock offset) + (playout delay)
+//
+// with the clock offset being the smallest (arrival - send time) seen
+// recently, and the playout delay the 99th percentile of how much later than
+// that recent events have arrived (network jitter and repaired losses),
+// plus a margin (-M, default 5 msec). Offset and delay are only adjusted
+// while all contacts are open, so the length of elements and gaps is
+// preserved. Events are given to the keyer (-d) with the SOFTPAD command
+// 0x14 (bit 2 = straight key is a protocol extension of this keyer).
+// If the sender falls silent for one second, all contacts are opened.
+//
+// At the end (-t or Ctrl-C), recv reports lost and late events, the timing
+// error (difference between the intervals of consecutive events at the
+// sender and as played) and, with -l (both sides on the same computer,
+// the clocks are identical), the end-to-end latency. With -o, every played
+// event goes to a CSV file (seq,state,latency_us,error_us).
+//
+// Test over loopback:
+//
+//   wkremote recv -l -t 65 7373 &
+//   wkremote send -g 25 -D 20 -J 15 -P 5 -t 60 127.0.0.1 7373
+//
+// Compile with:  cc -O2 -o wkremote wkremote.c
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define NHIST       4             // events per packet
+#define HEARTBEAT   50000         // usec between packets if nothing happens
+#define REPEAT      10000         // usec between repetitions of a new event
+#define SILENCE     1000000       // usec without packets before contacts are opened
+#define NOFFSET     256           // offset samples for clock offset and jitter
+#define QLEN        256           // playout queue
+#define NSTAT       200000        // max. number of events for statistics
+
+#define DOT_NOTE      4           // MIDI notes, see MY_DOT_NOTE etc. in the sketch
+#define DASH_NOTE     5
+#define STRAIGHT_NOTE 6
+
+static volatile int stop=0;
+
+static void on_signal(int sig) {
+  (void) sig;
+  stop=1;
+}
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000000ULL*ts.tv_sec + ts.tv_nsec/1000;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  for (int i=3; i >= 0; i--, v >>= 8) p[i]=v & 0xFF;
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+  for (int i=7; i >= 0; i--, v >>= 8) p[i]=v & 0xFF;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  uint32_t v=0;
+  for (int i=0; i<4; i++) v=(v << 8) | p[i];
+  return v;
+}
+
+static uint64_t get64(const uint8_t *p) {
+  uint64_t v=0;
+  for (int i=0; i<8; i++) v=(v << 8) | p[i];
+  return v;
+}
+
+//
+// Serial connection to the keyer (1200 baud, 8N2, as in wklat)
+//
+static int open_keyer(const char *name) {
+  struct termios tio;
+  int fd=open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+  if (fd < 0) {
+    perror(name);
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD | CSTOPB;
+    tio.c_cflag &= ~CRTSCTS;
+    cfsetispeed(&tio, B1200);
+    cfsetospeed(&tio, B1200);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static void keyer_write(int fd, const uint8_t *b, int n) {
+  while (n > 0) {
+    int k=write(fd, b, n);
+    if (k < 0) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      perror("keyer");
+      exit(1);
+    }
+    b += k;
+    n -= k;
+  }
+}
+
+//
+// Status bytes and echoes from the keyer are not needed
+//
+static void keyer_drain(int fd) {
+  uint8_t buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) ;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Sender
+//
+//////////////////////////////////////////////////////////////////////////////
+
+static uint64_t ev_time[NHIST];   // last events (ring, index: seq % NHIST)
+static uint8_t  ev_state[NHIST];
+static uint32_t ev_seq=0;         // number of events so far
+static uint8_t  contacts=0;       // bit 0: dot, bit 1: dash, bit 2: straight
+
+//
+// Injected network impairments: packets wait in "pending" until due
+//
+static struct pending {
+  uint64_t due;
+  int len;
+  uint8_t data[17 + 9*NHIST];
+} pending[1024];
+static int npending=0;
+static int delay_us=0, jitter_us=0, loss_pct=0;
+static long nsent=0, ndropped=0;
+static uint64_t last_tx=0;        // time of the last packet (including dropped ones)
+static int repeat=0;              // repetitions still to be sent
+
+static void send_packet() {
+  struct pending *p;
+  int n=ev_seq < NHIST ? ev_seq : NHIST;
+
+  last_tx=now_us();
+  if (rand() % 100 < loss_pct) {
+    ndropped++;
+    return;
+  }
+  if (npending == 1024) return;
+  p=&pending[npending++];
+  memcpy(p->data, "WKR1", 4);
+  put64(p->data+4, last_tx);            // send time
+  put32(p->data+12, ev_seq);
+  p->data[16]=n;
+  for (int i=0; i<n; i++) {
+    uint32_t seq=ev_seq-n+1+i;
+    put64(p->data+17+9*i, ev_time[seq % NHIST]);
+    p->data[25+9*i]=ev_state[seq % NHIST];
+  }
+  p->len=17+9*n;
+  p->due=last_tx + delay_us + (jitter_us > 0 ? rand() % jitter_us : 0);
+}
+
+static void flush_packets(int sock) {
+  uint64_t now=now_us();
+  int i=0;
+
+  while (i < npending) {
+    if (pending[i].due <= now) {
+      if (send(sock, pending[i].data, pending[i].len, 0) < 0 && errno != ECONNREFUSED) {
+        perror("send");
+      }
+      nsent++;
+      pending[i]=pending[--npending];
+    } else {
+      i++;
+    }
+  }
+}
+
+static void new_state(uint8_t state, uint64_t t) {
+  if (state == contacts) return;
+  contacts=state;
+  ev_seq++;
+  ev_time[ev_seq % NHIST]=t;
+  ev_state[ev_seq % NHIST]=state;
+  send_packet();
+  repeat=2;
+}
+
+//
+// MIDI note on/off for the contacts, with running status
+//
+static void midi_byte(uint8_t c) {
+  static uint8_t status=0, data[2];
+  static int ndata=0;
+
+  if (c & 0x80) {
+    if (c < 0xF8) {                 // real-time messages do not cancel running status
+      status=c;
+      ndata=0;
+    }
+    return;
+  }
+  if ((status & 0xE0) != 0x80) return; // only note on (0x9n) and note off (0x8n)
+  data[ndata++]=c;
+  if (ndata < 2) return;
+  ndata=0;
+  uint8_t bit = data[0] == DOT_NOTE ? 1 : data[0] == DASH_NOTE ? 2 : data[0] == STRAIGHT_NOTE ? 4 : 0;
+  if (bit == 0) return;
+  if ((status & 0xF0) == 0x90 && data[1] > 0) {
+    new_state(contacts | bit, now_us());
+  } else {
+    new_state(contacts & ~bit, now_us());
+  }
+}
+
+//
+// Synthetic operator: random patterns (none, dot, dash, both) held for
+// 1-4 dot lengths +/- 25%, as the operators of "hostsim batch"
+//
+static void synth_step(int wpm) {
+  static uint64_t next=0;
+  uint64_t now=now_us();
+  int unit=1200000/wpm;
+
+  if (now < next) return;
+  int r=rand();
+  new_state(r & 3, now);
+  next=now + (uint64_t) (((r >> 2) & 3) + 1) * unit * (75 + (r >> 4) % 51) / 100;
+}
+
+static int do_send(int argc, char **argv) {
+  const char *mididev=NULL, *keyerdev=NULL;
+  int wpm=0, seconds=0, opt, sock, midi=-1, keyer=-1;
+  struct addrinfo hints, *ai;
+  uint64_t t0;
+
+  while ((opt=getopt(argc, argv, "m:d:g:D:J:P:t:")) != -1) {
+    switch (opt) {
+      case 'm': mididev=optarg; break;
+      case 'd': keyerdev=optarg; break;
+      case 'g': wpm=atoi(optarg); break;
+      case 'D': delay_us=1000*atoi(optarg); break;
+      case 'J': jitter_us=1000*atoi(optarg); break;
+      case 'P': loss_pct=atoi(optarg); break;
+      case 't': seconds=atoi(optarg); break;
+      default:  return -1;
+    }
+  }
+  if (optind+2 != argc || (!mididev && wpm <= 0)) return -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_DGRAM;
+  if (getaddrinfo(argv[optind], argv[optind+1], &hints, &ai) != 0) {
+    fprintf(stderr, "unknown host/port %s %s\n", argv[optind], argv[optind+1]);
+    return 1;
+  }
+  sock=socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (sock < 0 || connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+    perror("socket");
+    return 1;
+  }
+  freeaddrinfo(ai);
+
+  if (keyerdev) {
+    keyer=open_keyer(keyerdev);
+    if (keyer < 0) return 1;
+    keyer_write(keyer, (const uint8_t *) "\x00\x02\x00\x38\x01", 5);   // host open, raw paddles
+  }
+  if (mididev) {
+    midi=open(mididev, O_RDONLY | O_NONBLOCK);
+    if (midi < 0) {
+      perror(mididev);
+      return 1;
+    }
+  }
+
+  srand(time(NULL));
+  t0=now_us();
+  while (!stop && (seconds == 0 || now_us() < t0 + 1000000ULL*seconds)) {
+    struct pollfd p;
+    int timeout=npending > 0 || wpm > 0 ? 1 : HEARTBEAT/1000;
+
+    p.fd=midi;
+    p.events=POLLIN;
+    poll(&p, midi >= 0 ? 1 : 0, timeout);
+    if (midi >= 0 && (p.revents & POLLIN)) {
+      uint8_t buf[64];
+      int n=read(midi, buf, sizeof(buf));
+      for (int i=0; i<n; i++) midi_byte(buf[i]);
+    }
+    if (wpm > 0) synth_step(wpm);
+    if (keyer >= 0) keyer_drain(keyer);
+    if (repeat > 0 && now_us() > last_tx + REPEAT) {
+      send_packet();
+      repeat--;
+    }
+    if (now_us() > last_tx + HEARTBEAT) send_packet();
+    if (npending > 0) flush_packets(sock);
+  }
+  new_state(0, now_us());               // leave all contacts open
+  while (npending > 0) {
+    usleep(1000);
+    flush_packets(sock);
+  }
+  if (keyer >= 0) {
+    keyer_write(keyer, (const uint8_t *) "\x00\x38\x00\x00\x03", 5);  // normal paddles, host close
+    close(keyer);
+  }
+  printf("events: %u  packets: %ld sent, %ld dropped\n", ev_seq, nsent, ndropped);
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Receiver
+//
+//////////////////////////////////////////////////////////////////////////////
+
+static int64_t  offs[NOFFSET];    // recent (arrival - send time), usec
+static int      noffs=0;
+static int64_t  evdel[NOFFSET];   // recent (arrival - time stamp) of events, usec
+static int      nevdel=0;
+static uint32_t queue_seq[QLEN];  // events waiting to be played (ring)
+static uint64_t queue_time[QLEN]; // ... sender's time stamp
+static uint8_t  queue_state[QLEN];
+static uint32_t qrx=0, qtx=0;
+
+static int cmp_int64(const void *a, const void *b) {
+  int64_t x=*(const int64_t *)a, y=*(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+//
+// clock offset = smallest recent (arrival - send time),
+// playout delay = 99th percentile of (arrival - time stamp) of the
+// events minus the offset, plus the margin
+//
+static void estimate(int64_t *offset, int64_t *delay, int margin) {
+  int64_t s[NOFFSET];
+  int n=noffs < NOFFSET ? noffs : NOFFSET;
+
+  if (n == 0) return;
+  memcpy(s, offs, n*sizeof(int64_t));
+  qsort(s, n, sizeof(int64_t), cmp_int64);
+  *offset=s[0];
+  *delay=margin;
+  n=nevdel < NOFFSET ? nevdel : NOFFSET;
+  if (n == 0) return;
+  memcpy(s, evdel, n*sizeof(int64_t));
+  qsort(s, n, sizeof(int64_t), cmp_int64);
+  if (s[(int) (0.99*(n-1))] > *offset) *delay += s[(int) (0.99*(n-1))] - *offset;
+}
+
+static void report(const char *what, int64_t *v, long n) {
+  if (n == 0) {
+    printf("%-14s -\n", what);
+    return;
+  }
+  qsort(v, n, sizeof(int64_t), cmp_int64);
+  printf("%-14s p50=%.1f ms  p99=%.1f ms  max=%.1f ms\n", what,
+         v[n/2]/1000.0, v[(long) (0.99*(n-1))]/1000.0, v[n-1]/1000.0);
+}
+
+static int do_recv(int argc, char **argv) {
+  const char *keyerdev=NULL, *csvname=NULL;
+  int margin=5000, loopback=0, seconds=0, opt, sock, keyer=-1;
+  struct sockaddr_in6 addr;
+  int v6only=0;
+  FILE *csv=NULL;
+  int64_t offset=0, delay=0;
+  uint32_t last_seq=0;              // last event queued
+  int synced=0;                     // set after the first packet
+  uint8_t state=0;                  // contacts as played
+  uint64_t t0, last_rx=0, prev_play=0, prev_time=0;
+  long nplayed=0, nlost=0, nlate=0, nsilent=0, nlat=0, nerr=0;
+  int64_t *lat, *err;
+
+  while ((opt=getopt(argc, argv, "d:M:lt:o:")) != -1) {
+    switch (opt) {
+      case 'd': keyerdev=optarg; break;
+      case 'M': margin=1000*atoi(optarg); break;
+      case 'l': loopback=1; break;
+      case 't': seconds=atoi(optarg); break;
+      case 'o': csvname=optarg; break;
+      default:  return -1;
+    }
+  }
+  if (optind+1 != argc) return -1;
+
+  sock=socket(AF_INET6, SOCK_DGRAM, 0);
+  setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));  // IPv4, too
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family=AF_INET6;
+  addr.sin6_addr=in6addr_any;
+  addr.sin6_port=htons(atoi(argv[optind]));
+  if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+  if (keyerdev) {
+    keyer=open_keyer(keyerdev);
+    if (keyer < 0) return 1;
+    keyer_write(keyer, (const uint8_t *) "\x00\x02", 2);               // host open
+  }
+  if (csvname) {
+    csv=fopen(csvname, "w");
+    if (!csv) {
+      perror(csvname);
+      return 1;
+    }
+    fprintf(csv, "seq,state,latency_us,error_us\n");
+  }
+  lat=(int64_t *) malloc(NSTAT*sizeof(int64_t));
+  err=(int64_t *) malloc(NSTAT*sizeof(int64_t));
+
+  t0=now_us();
+  while (!stop && (seconds == 0 || now_us() < t0 + 1000000ULL*seconds)) {
+    struct pollfd p;
+    uint8_t buf[256];
+    uint64_t now=now_us();
+    int timeout=10;
+
+    if (qrx != qtx) {
+      int64_t due=(int64_t) queue_time[qrx % QLEN] + offset + delay;
+      timeout=due > (int64_t) now ? (due - now + 999)/1000 : 0;
+      if (timeout > 10) timeout=10;
+    }
+    p.fd=sock;
+    p.events=POLLIN;
+    poll(&p, 1, timeout);
+
+    while ((p.revents & POLLIN) && !stop) {
+      int n=recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n < 0) break;
+      now=now_us();
+      if (n < 17 || memcmp(buf, "WKR1", 4) || n < 17+9*buf[16]) continue;
+      last_rx=now;
+      offs[noffs++ % NOFFSET]=(int64_t) now - (int64_t) get64(buf+4);
+      if (noffs == 1) estimate(&offset, &delay, margin);
+      uint32_t seq=get32(buf+12);
+      int nev=buf[16];
+      if (!synced) {
+        last_seq=seq-nev;             // earlier events are not ours
+        synced=1;
+      }
+      for (int i=0; i<nev; i++) {
+        uint32_t s=seq-nev+1+i;
+        if ((int32_t) (s - last_seq) <= 0) continue;          // already queued
+        if (s != last_seq+1) nlost += s - last_seq - 1;
+        if (qtx - qrx == QLEN) break;
+        queue_seq[qtx % QLEN]=s;
+        queue_time[qtx % QLEN]=get64(buf+17+9*i);
+        queue_state[qtx % QLEN]=buf[25+9*i];
+        evdel[nevdel++ % NOFFSET]=(int64_t) now - (int64_t) queue_time[qtx % QLEN];
+        qtx++;
+        last_seq=s;
+      }
+    }
+
+    //
+    // play all events that are due
+    //
+    now=now_us();
+    while (qrx != qtx) {
+      uint64_t t=queue_time[qrx % QLEN];
+      int64_t due=(int64_t) t + offset + delay;
+      if (due > (int64_t) now) break;
+      if ((int64_t) now - due > 2000) nlate++;
+      state=queue_state[qrx % QLEN];
+      if (keyer >= 0) {
+        uint8_t cmd[2]={0x14, state};
+        keyer_write(keyer, cmd, 2);
+      }
+      int64_t l=now - t, e=0;
+      if (loopback && nlat < NSTAT) lat[nlat++]=l;
+      if (nplayed > 0) {
+        e=((int64_t) now - (int64_t) prev_play) - ((int64_t) t - (int64_t) prev_time);
+        if (nerr < NSTAT) err[nerr++]=e < 0 ? -e : e;
+      }
+      if (csv) fprintf(csv, "%u,%d,%lld,%lld\n", queue_seq[qrx % QLEN], state,
+                       loopback ? (long long) l : 0LL, (long long) e);
+      prev_play=now;
+      prev_time=t;
+      nplayed++;
+      qrx++;
+    }
+
+    //
+    // adapt offset and delay only while idle, this does not change any
+    // element or gap except the one in progress (all contacts open)
+    //
+    if (state == 0 && qrx == qtx) estimate(&offset, &delay, margin);
+
+    //
+    // sender gone: open all contacts
+    //
+    if (state != 0 && qrx == qtx && now > last_rx + SILENCE) {
+      state=0;
+      nsilent++;
+      if (keyer >= 0) keyer_write(keyer, (const uint8_t *) "\x14\x00", 2);
+    }
+    if (keyer >= 0) keyer_drain(keyer);
+  }
+
+  if (keyer >= 0) {
+    keyer_write(keyer, (const uint8_t *) "\x14\x00\x00\x03", 4);      // contacts open, host close
+    close(keyer);
+  }
+  if (csv) fclose(csv);
+  printf("events: %ld played, %ld lost, %ld late, %ld time-outs\n", nplayed, nlost, nlate, nsilent);
+  printf("playout delay: %.1f ms (including %.1f ms margin)\n", delay/1000.0, margin/1000.0);
+  if (loopback) report("end-to-end", lat, nlat);
+  report("timing error", err, nerr);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int rc=-1;
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  if (argc > 1 && !strcmp(argv[1], "send")) rc=do_send(argc-1, argv+1);
+  if (argc > 1 && !strcmp(argv[1], "recv")) rc=do_recv(argc-1, argv+1);
+  if (rc < 0) {
+    fprintf(stderr, "usage: %s send [-m mididev] [-d device] [-g wpm] [-D delay] [-J jitter]\n"
+                    "                    [-P loss] [-t seconds] host port\n"
+                    "       %s recv [-d device] [-M margin] [-l] [-t seconds] [-o file.csv] port\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+  return rc;
+}